@@ -0,0 +1,496 @@
+/*
+ * The active boosts, kept in a min-heap by deadline, so the event loop
+ * only has to wait for the earliest one, and the detection keeps going
+ * while tasks are boosted. The queued and boosted tasks are held by a
+ * pidfd, so the policy of a task that exited is never restored onto the
+ * task that got its pid.
+ *
+ * With --adaptive_boost, the runtime and the duration of the boosts are
+ * sized per class of tasks, the comm without its digits, so kworker/3:1
+ * and kworker/5:2 share their size. After each boost, the progress of the
+ * task tells if the boost was too small, and is grown, or more than
+ * enough, and is shrunk, within the limits of -r and -d.
+ *
+ * With --noise_budget, the noise the boosts inject on a CPU, the runtime
+ * they can take from the workload, is capped over a sliding window.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "boost.h"
+
+#define BOOST_CLASSES		256
+#define BOOST_MAX_SHIFT		4	/* up to 16 times more or less than -r and -d */
+
+/*
+ * The size of the boosts of a class, as power of two factors of the
+ * configured runtime and duration. Protected by the boosts_lock of the
+ * callers.
+ */
+struct boost_class {
+	char name[COMM_SIZE];
+	int runtime_shift;
+	int duration_shift;
+};
+
+static struct boost_class boost_classes[BOOST_CLASSES];
+
+/*
+ * The boosts charged to the noise budget of a CPU, a ring of the ones not
+ * expired yet. Protected by the boosts_lock of the callers.
+ */
+#define NOISE_MAX_CHARGES	64
+
+struct noise_charge {
+	uint64_t end;		/* of the boost */
+	uint64_t noise;
+};
+
+struct noise_budget {
+	int first;
+	int nr_charges;
+	int exhausted;		/* reported */
+	uint64_t used;
+	struct noise_charge charges[NOISE_MAX_CHARGES];
+};
+
+static struct noise_budget *noise_budgets;
+
+static void swap_boosts(struct boost *a, struct boost *b)
+{
+	struct boost tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+static void sift_up(struct boost_heap *heap, int i)
+{
+	struct boost *boosts = heap->boosts;
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (boosts[parent].deadline <= boosts[i].deadline)
+			break;
+		swap_boosts(&boosts[parent], &boosts[i]);
+		i = parent;
+	}
+}
+
+static void sift_down(struct boost_heap *heap, int i)
+{
+	struct boost *boosts = heap->boosts;
+	int child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap->nr_boosts)
+			break;
+		if (child + 1 < heap->nr_boosts && boosts[child + 1].deadline < boosts[child].deadline)
+			child++;
+		if (boosts[i].deadline <= boosts[child].deadline)
+			break;
+		swap_boosts(&boosts[i], &boosts[child]);
+		i = child;
+	}
+}
+
+void boost_heap_push(struct boost_heap *heap, const struct boost *boost)
+{
+	if (heap->nr_boosts == heap->max_boosts) {
+		heap->max_boosts = heap->max_boosts ? heap->max_boosts * 2 : config_nr_cpus;
+		heap->boosts = realloc(heap->boosts, heap->max_boosts * sizeof(*heap->boosts));
+		if (!heap->boosts)
+			die("cannot allocate memory");
+	}
+
+	heap->boosts[heap->nr_boosts] = *boost;
+	sift_up(heap, heap->nr_boosts++);
+}
+
+/*
+ * Remove the boost at position i, copying it to boost.
+ */
+void boost_heap_remove(struct boost_heap *heap, int i, struct boost *boost)
+{
+	struct boost *boosts = heap->boosts;
+
+	*boost = boosts[i];
+	boosts[i] = boosts[--heap->nr_boosts];
+
+	if (i == heap->nr_boosts)
+		return;
+
+	sift_up(heap, i);
+	sift_down(heap, i);
+}
+
+/*
+ * Remove all the boosts of the cpu, copying them to boosts, in one pass
+ * and a rebuild of the heap. Returns the number of boosts removed.
+ */
+int boost_heap_remove_cpu(struct boost_heap *heap, struct cpu_info *cpu, struct boost *boosts)
+{
+	int nr_removed = 0;
+	int nr_kept = 0;
+	int i;
+
+	for (i = 0; i < heap->nr_boosts; i++) {
+		if (heap->boosts[i].cpu == cpu)
+			boosts[nr_removed++] = heap->boosts[i];
+		else
+			heap->boosts[nr_kept++] = heap->boosts[i];
+	}
+
+	heap->nr_boosts = nr_kept;
+
+	if (nr_removed)
+		for (i = nr_kept / 2 - 1; i >= 0; i--)
+			sift_down(heap, i);
+
+	return nr_removed;
+}
+
+/*
+ * Remove the boost with the earliest deadline, copying it to boost.
+ */
+void boost_heap_pop(struct boost_heap *heap, struct boost *boost)
+{
+	boost_heap_remove(heap, 0, boost);
+}
+
+/*
+ * The boost with the earliest deadline, NULL if there is none.
+ */
+struct boost *boost_heap_top(struct boost_heap *heap)
+{
+	if (!heap->nr_boosts)
+		return NULL;
+
+	return &heap->boosts[0];
+}
+
+/*
+ * Returns the position of the pid's boost, or -1 if it is not boosted.
+ */
+int boost_heap_find(struct boost_heap *heap, int pid)
+{
+	int i;
+
+	for (i = 0; i < heap->nr_boosts; i++)
+		if (heap->boosts[i].pid == pid)
+			return i;
+
+	return -1;
+}
+
+void boost_close_pidfd(struct boost *boost)
+{
+	if (boost->pidfd >= 0)
+		close(boost->pidfd);
+	boost->pidfd = -1;
+}
+
+/*
+ * Empty the heap, closing the pidfds of its tasks.
+ */
+void boost_heap_reset(struct boost_heap *heap)
+{
+	int i;
+
+	for (i = 0; i < heap->nr_boosts; i++)
+		boost_close_pidfd(&heap->boosts[i]);
+
+	heap->nr_boosts = 0;
+}
+
+void boost_heap_destroy(struct boost_heap *heap)
+{
+	boost_heap_reset(heap);
+	free(heap->boosts);
+	memset(heap, 0, sizeof(*heap));
+}
+
+/*
+ * The class of a comm: the comm without its digits.
+ */
+static void get_class_name(const char *comm, char *name)
+{
+	int i = 0;
+
+	for (; *comm && i < COMM_SIZE - 1; comm++)
+		if (!isdigit(*comm))
+			name[i++] = *comm;
+
+	name[i] = '\0';
+}
+
+/*
+ * The class of the comm, a new one if it is not known. When the table is
+ * full, a new class takes the slot of an old one.
+ */
+static struct boost_class *get_class(const char *comm)
+{
+	struct boost_class *class;
+	char name[COMM_SIZE];
+	unsigned int hash = 5381;
+	unsigned int i;
+	char *p;
+
+	get_class_name(comm, name);
+
+	for (p = name; *p; p++)
+		hash = hash * 33 + *p;
+
+	for (i = 0; i < BOOST_CLASSES; i++) {
+		class = &boost_classes[(hash + i) % BOOST_CLASSES];
+		if (!class->name[0] || !strcmp(class->name, name))
+			break;
+	}
+
+	if (i == BOOST_CLASSES)
+		class = &boost_classes[hash % BOOST_CLASSES];
+
+	if (strcmp(class->name, name)) {
+		memset(class, 0, sizeof(*class));
+		strcpy(class->name, name);
+	}
+
+	return class;
+}
+
+static uint64_t scale(uint64_t value, int shift)
+{
+	return shift >= 0 ? value << shift : value >> -shift;
+}
+
+static uint64_t clamp(uint64_t value, uint64_t min, uint64_t max)
+{
+	if (value < min)
+		return min;
+	if (value > max)
+		return max;
+	return value;
+}
+
+/*
+ * Set the runtime and the duration of the boost of a task, the ones of
+ * its class with --adaptive_boost, otherwise the ones of -r and -d.
+ */
+void boost_get_size(struct boost *boost)
+{
+	struct boost_class *class;
+
+	boost->runtime = config_dl_runtime;
+	boost->duration = config_boost_duration;
+
+	if (!config_adaptive_boost)
+		return;
+
+	class = get_class(boost->comm);
+
+	boost->runtime = clamp(scale(config_dl_runtime, class->runtime_shift),
+			       MIN_BOOST_RUNTIME, MAX_BOOST_RUNTIME);
+	if (boost->runtime > config_dl_period)
+		boost->runtime = config_dl_period;
+
+	/* At least a period, and not longer than the starvation it fixes. */
+	boost->duration = clamp(scale(config_boost_duration, class->duration_shift),
+				config_dl_period, config_starving_threshold);
+}
+
+static void adapt_shift(int *shift, int delta)
+{
+	*shift += delta;
+	if (*shift > BOOST_MAX_SHIFT)
+		*shift = BOOST_MAX_SHIFT;
+	if (*shift < -BOOST_MAX_SHIFT)
+		*shift = -BOOST_MAX_SHIFT;
+}
+
+/*
+ * Size the next boosts of the class of a task after its boost ended, from
+ * its progress: the CPU time it got, the timeslices it ran, and whether it
+ * is still queued.
+ *
+ * No progress: the runtime was too small to make a difference, it grows.
+ * Progress but still queued: the boost was too short, the duration grows,
+ * and so does the runtime if the task used most of it. Progress and no
+ * longer queued: the backlog was drained, the boost shrinks toward the
+ * smallest one that does it.
+ */
+void boost_adapt_size(struct boost *boost, uint64_t sum_exec_runtime, uint64_t nr_timeslices,
+		      int queued)
+{
+	struct boost_class *class;
+	struct boost next;
+	uint64_t nr_periods;
+	uint64_t granted;
+	uint64_t used;
+
+	if (!config_adaptive_boost)
+		return;
+
+	class = get_class(boost->comm);
+
+	used = sum_exec_runtime - boost->sum_exec_runtime;
+	nr_periods = boost->duration / config_dl_period;
+	granted = boost->runtime * (nr_periods ? nr_periods : 1);
+
+	if (!used && nr_timeslices == boost->nr_timeslices) {
+		adapt_shift(&class->runtime_shift, 1);
+	} else if (queued) {
+		adapt_shift(&class->duration_shift, 1);
+		if (used >= granted / 4 * 3)
+			adapt_shift(&class->runtime_shift, 1);
+	} else {
+		adapt_shift(&class->duration_shift, -1);
+		if (used < granted / 4)
+			adapt_shift(&class->runtime_shift, -1);
+	}
+
+	next = *boost;
+	boost_get_size(&next);
+
+	log_verbose("%s-%d ran %.6f s out of %.6f s%s, next %s boosts: %lu ns for %.3f s\n",
+		    boost->comm, boost->pid, ns_to_sec(used), ns_to_sec(granted),
+		    queued ? " and is still queued" : "", class->name,
+		    (unsigned long) next.runtime, ns_to_sec(next.duration));
+}
+
+/*
+ * The noise of a boost: its runtime in all the periods of its duration,
+ * as if the task used it all.
+ */
+uint64_t boost_noise(const struct boost *boost)
+{
+	uint64_t nr_periods = boost->duration / config_dl_period;
+
+	return boost->runtime * (nr_periods ? nr_periods : 1);
+}
+
+/*
+ * A boost injects its noise until its end, so it counts in the windows
+ * that include any part of it: it is charged until a window after its end.
+ */
+static void expire_charges(struct noise_budget *budget, uint64_t now)
+{
+	struct noise_charge *charge;
+
+	while (budget->nr_charges) {
+		charge = &budget->charges[budget->first];
+		if (charge->end + config_noise_window > now)
+			break;
+
+		budget->used -= charge->noise;
+		budget->first = (budget->first + 1) % NOISE_MAX_CHARGES;
+		budget->nr_charges--;
+	}
+}
+
+static struct noise_charge *get_charge(struct noise_budget *budget, int i)
+{
+	return &budget->charges[(budget->first + i) % NOISE_MAX_CHARGES];
+}
+
+/*
+ * Charge the noise of a boost ending at end to the budget of the CPU.
+ * Returns 0 if it fits the budget, -1 if the boost has to be deferred.
+ *
+ * With all the slots taken, the charge is merged into the newest one,
+ * which then lasts until the later of the two ends.
+ */
+int noise_budget_charge(int cpu, uint64_t noise, uint64_t now, uint64_t end)
+{
+	struct noise_budget *budget;
+	struct noise_charge *charge;
+
+	if (!config_noise_budget)
+		return 0;
+
+	if (!noise_budgets)
+		noise_budgets = allocate_memory(config_nr_cpus, sizeof(*noise_budgets));
+
+	budget = &noise_budgets[cpu];
+	expire_charges(budget, now);
+
+	if (budget->used + noise > config_noise_budget) {
+		if (!budget->exhausted)
+			log_msg("cpu %d used its noise budget of %.6f s per %.3f s, deferring its boosts\n",
+				cpu, ns_to_sec(config_noise_budget), ns_to_sec(config_noise_window));
+		budget->exhausted = 1;
+		return -1;
+	}
+
+	if (budget->exhausted)
+		log_msg("cpu %d has noise budget again, resuming its boosts\n", cpu);
+	budget->exhausted = 0;
+
+	if (budget->nr_charges == NOISE_MAX_CHARGES) {
+		charge = get_charge(budget, budget->nr_charges - 1);
+		if (charge->end < end)
+			charge->end = end;
+		charge->noise += noise;
+	} else {
+		charge = get_charge(budget, budget->nr_charges++);
+		charge->end = end;
+		charge->noise = noise;
+	}
+	budget->used += noise;
+
+	return 0;
+}
+
+/*
+ * Give back the charge of a boost that failed. It has a slot of its own,
+ * or was merged into the newest one; the slot is freed once it holds no
+ * noise.
+ */
+void noise_budget_refund(int cpu, uint64_t noise, uint64_t end)
+{
+	struct noise_budget *budget;
+	struct noise_charge *charge;
+	int i;
+
+	if (!config_noise_budget || !noise_budgets || !noise_budgets[cpu].nr_charges)
+		return;
+
+	budget = &noise_budgets[cpu];
+
+	for (i = budget->nr_charges - 1; i >= 0; i--) {
+		charge = get_charge(budget, i);
+		if (charge->end == end && charge->noise == noise)
+			break;
+	}
+
+	if (i < 0) {
+		i = budget->nr_charges - 1;
+		charge = get_charge(budget, i);
+		if (charge->end < end || charge->noise < noise)
+			return;
+	}
+
+	budget->used -= noise;
+	charge->noise -= noise;
+	if (charge->noise)
+		return;
+
+	for (; i < budget->nr_charges - 1; i++)
+		*get_charge(budget, i) = *get_charge(budget, i + 1);
+	budget->nr_charges--;
+}
+
+void noise_budget_destroy(void)
+{
+	free(noise_budgets);
+	noise_budgets = NULL;
+}
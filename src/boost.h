@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __BOOST_H
+#define __BOOST_H
+
+/*
+ * The policy of the boosts of the fair server of a CPU, see fair_server.c.
+ */
+#define BOOST_FAIR_SERVER	(-1)
+
+/*
+ * The bounds of the runtime of a boost.
+ */
+#define MIN_BOOST_RUNTIME	8000
+#define MAX_BOOST_RUNTIME	1000000
+
+/*
+ * An active boost. deadline is the time of its next event: its end for
+ * SCHED_DEADLINE, the next toggle for the SCHED_FIFO emulation.
+ */
+struct boost {
+	uint64_t deadline;
+	uint64_t end;
+	uint64_t runtime;	/* per period */
+	uint64_t duration;
+	uint64_t sum_exec_runtime;	/* at the start, for the adaptive sizing */
+	uint64_t nr_timeslices;
+	int policy;
+	int boosted;		/* SCHED_FIFO: in the runtime part of the period */
+	int tgid;
+	int pid;
+	int pidfd;		/* the task, -1 if none */
+	struct cpu_info *cpu;
+	struct sched_attr attr;	/* the policy to restore */
+	char comm[COMM_SIZE];
+};
+
+/*
+ * The active boosts, in a min-heap by deadline.
+ */
+struct boost_heap {
+	int nr_boosts;
+	int max_boosts;
+	struct boost *boosts;
+};
+
+void boost_heap_push(struct boost_heap *heap, const struct boost *boost);
+void boost_heap_pop(struct boost_heap *heap, struct boost *boost);
+void boost_heap_remove(struct boost_heap *heap, int i, struct boost *boost);
+int boost_heap_remove_cpu(struct boost_heap *heap, struct cpu_info *cpu, struct boost *boosts);
+struct boost *boost_heap_top(struct boost_heap *heap);
+int boost_heap_find(struct boost_heap *heap, int pid);
+void boost_heap_reset(struct boost_heap *heap);
+void boost_heap_destroy(struct boost_heap *heap);
+
+void boost_close_pidfd(struct boost *boost);
+
+uint64_t boost_noise(const struct boost *boost);
+int noise_budget_charge(int cpu, uint64_t noise, uint64_t now, uint64_t end);
+void noise_budget_refund(int cpu, uint64_t noise, uint64_t end);
+void noise_budget_destroy(void);
+
+void boost_get_size(struct boost *boost);
+void boost_adapt_size(struct boost *boost, uint64_t sum_exec_runtime, uint64_t nr_timeslices,
+		      int queued);
+
+#endif /* __BOOST_H */
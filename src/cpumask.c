@@ -0,0 +1,202 @@
+/*
+ * CPU sets as bitmaps, so the loops over the monitored CPUs only visit
+ * the CPUs set, a few words for hundreds of CPUs.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stalld.h"
+
+static int nr_words(const struct cpumask *mask)
+{
+	return (mask->nr_cpus + BITS_PER_LONG - 1) / BITS_PER_LONG;
+}
+
+/*
+ * An empty mask for nr_cpus CPUs.
+ */
+void cpumask_init(struct cpumask *mask, int nr_cpus)
+{
+	mask->nr_cpus = nr_cpus;
+	mask->bits = allocate_memory(nr_words(mask), sizeof(unsigned long));
+}
+
+void cpumask_destroy(struct cpumask *mask)
+{
+	free(mask->bits);
+	mask->bits = NULL;
+	mask->nr_cpus = 0;
+}
+
+void cpumask_clear(struct cpumask *mask)
+{
+	memset(mask->bits, 0, nr_words(mask) * sizeof(unsigned long));
+}
+
+void cpumask_setall(struct cpumask *mask)
+{
+	int i;
+
+	for (i = 0; i < mask->nr_cpus; i++)
+		cpumask_set_cpu(i, mask);
+}
+
+/*
+ * dst = a & b, the three masks of the same size.
+ */
+void cpumask_and(struct cpumask *dst, const struct cpumask *a, const struct cpumask *b)
+{
+	int i;
+
+	for (i = 0; i < nr_words(dst); i++)
+		dst->bits[i] = a->bits[i] & b->bits[i];
+}
+
+/*
+ * The first CPU set after cpu, or nr_cpus if there is none.
+ */
+int cpumask_next(int cpu, const struct cpumask *mask)
+{
+	unsigned long bits;
+	int word;
+
+	cpu++;
+	if (cpu >= mask->nr_cpus)
+		return mask->nr_cpus;
+
+	word = cpu / BITS_PER_LONG;
+	bits = mask->bits[word] & (~0UL << (cpu % BITS_PER_LONG));
+
+	while (!bits) {
+		if (++word >= nr_words(mask))
+			return mask->nr_cpus;
+		bits = mask->bits[word];
+	}
+
+	cpu = word * BITS_PER_LONG + __builtin_ctzl(bits);
+
+	return cpu < mask->nr_cpus ? cpu : mask->nr_cpus;
+}
+
+int cpumask_weight(const struct cpumask *mask)
+{
+	int weight = 0;
+	int i;
+
+	for (i = 0; i < nr_words(mask); i++)
+		weight += __builtin_popcountl(mask->bits[i]);
+
+	return weight;
+}
+
+/*
+ * Set the CPUs of a cpu list, as in sysfs ("0-3,8\n"). The CPUs past the
+ * mask are ignored. Returns the number of CPUs in the list, or -1 if it is
+ * not a cpu list.
+ */
+int cpumask_parse(struct cpumask *mask, const char *list)
+{
+	const char *p = list;
+	int count = 0;
+	char *end;
+	long first;
+	long last;
+	long cpu;
+
+	while (*p && !isspace(*p)) {
+		if (!isdigit(*p))
+			return -1;
+
+		first = strtol(p, &end, 10);
+		last = first;
+		p = end;
+
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				return -1;
+			p = end;
+		}
+
+		for (cpu = first; cpu <= last && cpu < mask->nr_cpus; cpu++) {
+			cpumask_set_cpu(cpu, mask);
+			count++;
+		}
+
+		if (*p == ',')
+			p++;
+	}
+
+	return count;
+}
+
+/*
+ * Set the CPUs of the cpu list in the file at path. Returns the number of
+ * CPUs, 0 if the file cannot be read or is not a cpu list.
+ */
+int cpumask_read(struct cpumask *mask, const char *path)
+{
+	char buffer[4096];
+	int retval;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	retval = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+
+	if (retval <= 0)
+		return 0;
+
+	buffer[retval] = '\0';
+
+	retval = cpumask_parse(mask, buffer);
+
+	return retval > 0 ? retval : 0;
+}
+
+/*
+ * The number of CPUs the system can ever have, online or not, from the
+ * last of the possible CPUs. The per-CPU state is sized after it, so the
+ * CPU hotplug never needs to resize it.
+ */
+int get_nr_possible_cpus(void)
+{
+	char buffer[4096];
+	long nr_cpus = 0;
+	char *p, *end;
+	int retval;
+	int fd;
+
+	fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+	if (fd >= 0) {
+		retval = read(fd, buffer, sizeof(buffer) - 1);
+		close(fd);
+
+		if (retval > 0) {
+			buffer[retval] = '\0';
+			for (p = buffer; *p; p = end) {
+				if (!isdigit(*p)) {
+					end = p + 1;
+					continue;
+				}
+				nr_cpus = strtol(p, &end, 10) + 1;
+			}
+		}
+	}
+
+	if (nr_cpus < 1)
+		nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	return nr_cpus;
+}
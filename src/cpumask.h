@@ -0,0 +1,51 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __CPUMASK_H
+#define __CPUMASK_H
+
+#define BITS_PER_LONG	(8 * (int) sizeof(unsigned long))
+
+/*
+ * A set of CPUs, as a bitmap of nr_cpus bits.
+ */
+struct cpumask {
+	int nr_cpus;
+	unsigned long *bits;
+};
+
+void cpumask_init(struct cpumask *mask, int nr_cpus);
+void cpumask_destroy(struct cpumask *mask);
+void cpumask_clear(struct cpumask *mask);
+void cpumask_setall(struct cpumask *mask);
+void cpumask_and(struct cpumask *dst, const struct cpumask *a, const struct cpumask *b);
+int cpumask_next(int cpu, const struct cpumask *mask);
+int cpumask_weight(const struct cpumask *mask);
+int cpumask_parse(struct cpumask *mask, const char *list);
+int cpumask_read(struct cpumask *mask, const char *path);
+int get_nr_possible_cpus(void);
+
+static inline void cpumask_set_cpu(int cpu, struct cpumask *mask)
+{
+	mask->bits[cpu / BITS_PER_LONG] |= 1UL << (cpu % BITS_PER_LONG);
+}
+
+static inline void cpumask_clear_cpu(int cpu, struct cpumask *mask)
+{
+	mask->bits[cpu / BITS_PER_LONG] &= ~(1UL << (cpu % BITS_PER_LONG));
+}
+
+static inline int cpumask_test_cpu(int cpu, const struct cpumask *mask)
+{
+	return !!(mask->bits[cpu / BITS_PER_LONG] & (1UL << (cpu % BITS_PER_LONG)));
+}
+
+/*
+ * Walk the CPUs set in the mask, skipping the unset ones a word at a time.
+ */
+#define for_each_cpu(cpu, mask)					\
+	for ((cpu) = cpumask_next(-1, (mask));			\
+	     (cpu) < (mask)->nr_cpus;				\
+	     (cpu) = cpumask_next((cpu), (mask)))
+
+#endif /* __CPUMASK_H */
@@ -0,0 +1,392 @@
+/*
+ * The stalld event loop.
+ *
+ * Each thread that waits has its own epoll instance, with a timerfd for
+ * its scan ticks and one for its deboost deadline. All the loops also
+ * wait for the signalfd and for the shutdown eventfd, so a signal stops
+ * the whole daemon right away, even in the middle of a boost. The loop of
+ * the main thread also waits for the fds of the event driven backends,
+ * and processes their events as they come, and for the kernel uevents,
+ * to follow the CPU hotplug.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "stalld.h"
+#include "event_loop.h"
+
+#define LOOP_MAX_EVENTS		16
+#define UEVENT_BUFFER_SIZE	4096
+#define CPU_DEVPATH		"/devices/system/cpu/cpu"
+
+/*
+ * Where an epoll event comes from, in its data.
+ */
+enum loop_source {
+	SOURCE_SIGNAL = 0,
+	SOURCE_SHUTDOWN,
+	SOURCE_TICK,
+	SOURCE_DEBOOST,
+	SOURCE_BACKEND,
+	SOURCE_HOTPLUG,
+};
+
+static int signal_fd = -1;
+
+/*
+ * The kernel uevents socket, -1 if the CPU hotplug is not followed.
+ */
+static int hotplug_fd = -1;
+
+/*
+ * Never read: once written, it wakes up all the loops for good.
+ */
+static int shutdown_fd = -1;
+
+/*
+ * The loop of the main thread, that waits for the backend fds.
+ */
+static struct stalld_loop *backend_loop;
+
+void stalld_shutdown(void)
+{
+	uint64_t value = 1;
+
+	running = 0;
+
+	if (shutdown_fd >= 0 && write(shutdown_fd, &value, sizeof(value)) < 0)
+		warn("cannot wake up the loops: %s\n", strerror(errno));
+}
+
+int setup_signal_handling(void)
+{
+	sigset_t sigset;
+	int status;
+
+	/* Mask off all signals. */
+	status = sigfillset(&sigset);
+	if (status) {
+		warn("setting up full signal set %s\n", strerror(errno));
+		return status;
+	}
+
+	status = pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	if (status) {
+		warn("setting signal mask: %s\n", strerror(status));
+		return status;
+	}
+
+	/* SIGINT, SIGTERM and SIGHUP are read from the signalfd. */
+	status = sigemptyset(&sigset);
+	if (status) {
+		warn("creating empty signal set: %s\n", strerror(errno));
+		return status;
+	}
+
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGHUP);
+
+	signal_fd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		warn("creating the signalfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	shutdown_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shutdown_fd < 0) {
+		warn("creating the shutdown eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Follow the CPU hotplug with the kernel uevents. Without them, the online
+ * CPUs are only read again on SIGHUP.
+ */
+int setup_hotplug_events(void)
+{
+	struct sockaddr_nl addr;
+
+	hotplug_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    NETLINK_KOBJECT_UEVENT);
+	if (hotplug_fd < 0) {
+		warn("cannot follow the cpu hotplug: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* the kernel uevents */
+
+	if (bind(hotplug_fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		warn("cannot follow the cpu hotplug: %s\n", strerror(errno));
+		close(hotplug_fd);
+		hotplug_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int loop_add_fd(struct stalld_loop *loop, int fd, enum loop_source source)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = source;
+
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+		warn("cannot add fd %d to the event loop: %s\n", fd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int loop_init(struct stalld_loop *loop, int main_loop)
+{
+	int nr_fds;
+	int *fds;
+	int i;
+
+	loop->tick_fd = -1;
+	loop->deboost_fd = -1;
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		warn("cannot create the event loop: %s\n", strerror(errno));
+		return -1;
+	}
+
+	loop->tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	loop->deboost_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->tick_fd < 0 || loop->deboost_fd < 0) {
+		warn("cannot create the loop timers: %s\n", strerror(errno));
+		goto out_destroy;
+	}
+
+	if (loop_add_fd(loop, signal_fd, SOURCE_SIGNAL)
+	    || loop_add_fd(loop, shutdown_fd, SOURCE_SHUTDOWN)
+	    || loop_add_fd(loop, loop->tick_fd, SOURCE_TICK)
+	    || loop_add_fd(loop, loop->deboost_fd, SOURCE_DEBOOST))
+		goto out_destroy;
+
+	if (main_loop && backend->event_fds) {
+		nr_fds = backend->event_fds(&fds);
+		for (i = 0; i < nr_fds; i++)
+			if (loop_add_fd(loop, fds[i], SOURCE_BACKEND))
+				goto out_destroy;
+	}
+
+	if (main_loop && hotplug_fd >= 0 && loop_add_fd(loop, hotplug_fd, SOURCE_HOTPLUG))
+		goto out_destroy;
+
+	if (main_loop)
+		backend_loop = loop;
+
+	return 0;
+
+out_destroy:
+	loop_destroy(loop);
+	return -1;
+}
+
+void loop_destroy(struct stalld_loop *loop)
+{
+	if (loop == backend_loop)
+		backend_loop = NULL;
+
+	if (loop->deboost_fd >= 0)
+		close(loop->deboost_fd);
+	if (loop->tick_fd >= 0)
+		close(loop->tick_fd);
+	if (loop->epoll_fd >= 0)
+		close(loop->epoll_fd);
+
+	loop->epoll_fd = loop->tick_fd = loop->deboost_fd = -1;
+}
+
+/*
+ * Wait for a backend fd opened after the loop of the main thread started,
+ * e.g., for a CPU coming online. The ones opened before are added by
+ * loop_init().
+ */
+int loop_add_backend_fd(int fd)
+{
+	if (!backend_loop)
+		return 0;
+
+	return loop_add_fd(backend_loop, fd, SOURCE_BACKEND);
+}
+
+void loop_remove_backend_fd(int fd)
+{
+	if (backend_loop)
+		epoll_ctl(backend_loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int set_timer(int fd, uint64_t value, uint64_t interval, int flags)
+{
+	struct itimerspec its;
+
+	its.it_value.tv_sec = value / NS_PER_SEC;
+	its.it_value.tv_nsec = value % NS_PER_SEC;
+	its.it_interval.tv_sec = interval / NS_PER_SEC;
+	its.it_interval.tv_nsec = interval % NS_PER_SEC;
+
+	if (timerfd_settime(fd, flags, &its, NULL)) {
+		warn("cannot set a loop timer: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Start the periodic scan ticks, the first one a period from now.
+ */
+int loop_set_tick(struct stalld_loop *loop, uint64_t period)
+{
+	return set_timer(loop->tick_fd, period, period, 0);
+}
+
+/*
+ * Set the next tick, once, at deadline in get_time_ns() time.
+ */
+int loop_set_tick_at(struct stalld_loop *loop, uint64_t deadline)
+{
+	return set_timer(loop->tick_fd, deadline, 0, TFD_TIMER_ABSTIME);
+}
+
+/*
+ * Set the deboost deadline, in get_time_ns() time. 0 cancels it.
+ */
+int loop_set_deboost(struct stalld_loop *loop, uint64_t deadline)
+{
+	return set_timer(loop->deboost_fd, deadline, 0, TFD_TIMER_ABSTIME);
+}
+
+static int read_timer(int fd)
+{
+	uint64_t expirations;
+
+	/* Another reader, or a timer set again, might have consumed it. */
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	return 1;
+}
+
+static int read_signals(void)
+{
+	struct signalfd_siginfo info;
+	int events = 0;
+
+	/* The loops of the other threads might get them first. */
+	while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGHUP) {
+			log_msg("received SIGHUP, scanning the run-queues\n");
+			events |= LOOP_RESCAN;
+			continue;
+		}
+
+		log_msg("received signal %d, starting shutdown\n", info.ssi_signo);
+		stalld_shutdown();
+		events |= LOOP_SHUTDOWN;
+	}
+
+	return events;
+}
+
+/*
+ * Returns LOOP_HOTPLUG if a CPU went online or offline. The other uevents
+ * are dropped.
+ */
+static int read_hotplug_events(void)
+{
+	char buffer[UEVENT_BUFFER_SIZE];
+	char *devpath;
+	int events = 0;
+	ssize_t len;
+
+	while ((len = recv(hotplug_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		buffer[len] = '\0';
+
+		/* The header is action@devpath, e.g., offline@/devices/system/cpu/cpu3. */
+		devpath = strchr(buffer, '@');
+		if (devpath && !strncmp(devpath + 1, CPU_DEVPATH, strlen(CPU_DEVPATH)))
+			events |= LOOP_HOTPLUG;
+	}
+
+	return events;
+}
+
+/*
+ * Wait for the next tick, deboost deadline, rescan request, CPU hotplug or shutdown,
+ * processing the backend events meanwhile.
+ *
+ * Returns the LOOP_* events that happened.
+ */
+int loop_wait(struct stalld_loop *loop)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	int nr_events;
+	int ret = 0;
+	int i;
+
+	while (!ret) {
+		nr_events = epoll_wait(loop->epoll_fd, events, LOOP_MAX_EVENTS, -1);
+		if (nr_events < 0) {
+			if (errno == EINTR)
+				continue;
+			die("event loop failed: %s\n", strerror(errno));
+		}
+
+		for (i = 0; i < nr_events; i++) {
+			switch (events[i].data.u32) {
+			case SOURCE_SIGNAL:
+				ret |= read_signals();
+				break;
+			case SOURCE_SHUTDOWN:
+				ret |= LOOP_SHUTDOWN;
+				break;
+			case SOURCE_TICK:
+				if (read_timer(loop->tick_fd))
+					ret |= LOOP_TICK;
+				break;
+			case SOURCE_DEBOOST:
+				if (read_timer(loop->deboost_fd))
+					ret |= LOOP_DEBOOST;
+				break;
+			case SOURCE_BACKEND:
+				if (backend->process_events())
+					ret |= LOOP_RESCAN;
+				break;
+			case SOURCE_HOTPLUG:
+				ret |= read_hotplug_events();
+				break;
+			}
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stdint.h>
+
+/*
+ * What woke up loop_wait().
+ */
+#define LOOP_TICK	(1 << 0)	/* the scan period elapsed */
+#define LOOP_DEBOOST	(1 << 1)	/* the deboost deadline expired */
+#define LOOP_RESCAN	(1 << 2)	/* SIGHUP, or the backend asked for a scan */
+#define LOOP_SHUTDOWN	(1 << 3)	/* SIGINT or SIGTERM */
+#define LOOP_HOTPLUG	(1 << 4)	/* a CPU went online or offline */
+
+/*
+ * The event loop of a stalld thread: an epoll instance waiting for the
+ * thread's timers, the signals and, in the main thread, the backend.
+ */
+struct stalld_loop {
+	int epoll_fd;
+	int tick_fd;
+	int deboost_fd;
+};
+
+int setup_hotplug_events(void);
+int loop_init(struct stalld_loop *loop, int main_loop);
+void loop_destroy(struct stalld_loop *loop);
+int loop_add_backend_fd(int fd);
+void loop_remove_backend_fd(int fd);
+int loop_set_tick(struct stalld_loop *loop, uint64_t period);
+int loop_set_tick_at(struct stalld_loop *loop, uint64_t deadline);
+int loop_set_deboost(struct stalld_loop *loop, uint64_t deadline);
+int loop_wait(struct stalld_loop *loop);
+
+void stalld_shutdown(void);
+
+#endif /* __EVENT_LOOP_H */
@@ -0,0 +1,184 @@
+/*
+ * Boosting through the DL-server of the fair class.
+ *
+ * On kernels with the fair_server, the starving fair tasks of a CPU are
+ * boosted all at once, raising the bandwidth of the fair server of the
+ * CPU for the boost duration, instead of a sched_setattr() per task. The
+ * tasks that start waiting during the boost are covered too. The server
+ * is restored to its runtime and period at the end of the boost.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "fair_server.h"
+
+struct fair_server {
+	int boosted;
+	uint64_t runtime;	/* the ones to restore */
+	uint64_t period;
+};
+
+static char fair_server_path[MAX_PATH];
+static struct fair_server *servers;
+
+static int read_server_file(int cpu, const char *file, uint64_t *value)
+{
+	char path[MAX_PATH + 32];
+	char buffer[32];
+	int retval;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cpu%d/%s", fair_server_path, cpu, file);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	retval = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+
+	if (retval <= 0)
+		return -1;
+
+	buffer[retval] = '\0';
+	*value = strtoull(buffer, NULL, 10);
+
+	return 0;
+}
+
+/*
+ * Returns -1 with errno set on failure, EBUSY if the admission control
+ * refused the bandwidth.
+ */
+static int write_server_file(int cpu, const char *file, uint64_t value)
+{
+	char path[MAX_PATH + 32];
+	char buffer[32];
+	int retval;
+	int len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cpu%d/%s", fair_server_path, cpu, file);
+	len = snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long) value);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+
+	retval = write(fd, buffer, len);
+	close(fd);
+
+	return retval == len ? 0 : -1;
+}
+
+/*
+ * Set the runtime and the period of a server, in the order that keeps
+ * the runtime within the period at each write.
+ */
+static int set_server(int cpu, uint64_t runtime, uint64_t period, uint64_t old_period)
+{
+	if (period > old_period) {
+		if (write_server_file(cpu, "period", period))
+			return -1;
+		return write_server_file(cpu, "runtime", runtime);
+	}
+
+	if (write_server_file(cpu, "runtime", runtime))
+		return -1;
+	return write_server_file(cpu, "period", period);
+}
+
+/*
+ * Returns 0 if the fair servers can be boosted, -1 otherwise.
+ */
+int fair_server_init(void)
+{
+	uint64_t runtime;
+
+	if (get_dl_server_path(fair_server_path, sizeof(fair_server_path)))
+		return -1;
+
+	if (read_server_file(0, "runtime", &runtime)) {
+		warn("cannot read the fair server of cpu 0: %s\n", strerror(errno));
+		return -1;
+	}
+
+	servers = allocate_memory(config_nr_cpus, sizeof(*servers));
+
+	log_msg("boosting the starving fair tasks with the fair server of their cpu\n");
+	return 0;
+}
+
+/*
+ * Is the fair server of the CPU boosted?
+ */
+int fair_server_boosted(int cpu)
+{
+	return servers[cpu].boosted;
+}
+
+/*
+ * Raise the bandwidth of the fair server of the CPU to runtime every
+ * period. Returns 0 on success, 1 if the server already has as much
+ * bandwidth, and -1 with errno set on failure.
+ */
+int fair_server_boost(int cpu, uint64_t runtime, uint64_t period)
+{
+	struct fair_server *server = &servers[cpu];
+	int error;
+
+	if (read_server_file(cpu, "runtime", &server->runtime)
+	    || read_server_file(cpu, "period", &server->period))
+		return -1;
+
+	/* runtime / period <= server runtime / server period */
+	if (runtime * server->period <= server->runtime * period)
+		return 1;
+
+	if (set_server(cpu, runtime, period, server->period)) {
+		error = errno;
+		if (error != EBUSY)
+			log_msg("cannot boost the fair server of cpu %d: %s\n", cpu, strerror(error));
+		/* Put it back as it was, in case only the period changed. */
+		set_server(cpu, server->runtime, server->period, period);
+		errno = error;
+		return -1;
+	}
+
+	server->boosted = 1;
+	log_msg("boosted the fair server of cpu %d to %llu ns every %llu ns\n", cpu,
+		(unsigned long long) runtime, (unsigned long long) period);
+
+	return 0;
+}
+
+void fair_server_restore(int cpu)
+{
+	struct fair_server *server = &servers[cpu];
+	uint64_t period;
+
+	if (!server->boosted)
+		return;
+
+	if (read_server_file(cpu, "period", &period)
+	    || set_server(cpu, server->runtime, server->period, period))
+		log_msg("cannot restore the fair server of cpu %d: %s\n", cpu, strerror(errno));
+
+	server->boosted = 0;
+}
+
+void fair_server_destroy(void)
+{
+	free(servers);
+	servers = NULL;
+}
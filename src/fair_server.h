@@ -0,0 +1,13 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __FAIR_SERVER_H
+#define __FAIR_SERVER_H
+
+int fair_server_init(void);
+int fair_server_boosted(int cpu);
+int fair_server_boost(int cpu, uint64_t runtime, uint64_t period);
+void fair_server_restore(int cpu);
+void fair_server_destroy(void);
+
+#endif /* __FAIR_SERVER_H */
@@ -0,0 +1,456 @@
+/*
+ * ftrace_track backend: tracks the run-queues with the sched events read
+ * from private tracefs instances, for systems without BPF.
+ *
+ * The sched_switch events are only recorded on the monitored CPUs, using
+ * the instance's tracing_cpumask. A wakeup or a migration is recorded on
+ * the CPU doing it, that might not be monitored, so those events are
+ * recorded on all CPUs in a second instance, filtered by the target CPU.
+ *
+ * The per-CPU trace_pipe_raw files give the binary ring buffer pages:
+ * the full pages are moved with splice(), then the page being written
+ * is read.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "sched_events.h"
+
+#define FTRACE_BUFFER_SIZE_KB	"2048"
+#define FTRACE_BUFFER_PERCENT	"50"
+
+/*
+ * Upper bound of pages read from a CPU buffer at once, so a very busy CPU
+ * does not keep the others waiting.
+ */
+#define FTRACE_MAX_DRAIN_PAGES	1024
+
+/*
+ * Ring buffer event header: type_len:5, time_delta:27.
+ */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RB_TYPE_LEN(header)	((header) >> 27)
+#define RB_TIME_DELTA(header)	((header) & ((1U << 27) - 1))
+#else
+#define RB_TYPE_LEN(header)	((header) & 0x1f)
+#define RB_TIME_DELTA(header)	((header) >> 5)
+#endif
+
+#define RB_TYPE_PADDING		29
+#define RB_TYPE_TIME_EXTEND	30
+#define RB_TYPE_TIME_STAMP	31
+#define RB_TS_SHIFT		27
+
+/*
+ * Flags in the commit field of the page header.
+ */
+#define RB_MISSED_EVENTS	(1UL << 31)
+#define RB_MISSED_STORED	(1UL << 30)
+
+struct ftrace_cpu {
+	int cpu;
+	int fd;
+	int pipe[2];
+};
+
+struct ftrace_instance {
+	const char *name;
+	int all_cpus;
+	int nr_events;
+	enum sched_event_type events[3];
+	int created;
+	int nr_cpus;
+	struct ftrace_cpu *cpus;
+};
+
+static struct ftrace_instance instances[] = {
+	{
+		.name		= "stalld",
+		.all_cpus	= 0,
+		.nr_events	= 1,
+		.events		= { SCHED_SWITCH },
+	},
+	{
+		.name		= "stalld_wakeup",
+		.all_cpus	= 1,
+		.nr_events	= 3,
+		.events		= { SCHED_WAKEUP, SCHED_WAKEUP_NEW, SCHED_MIGRATE_TASK },
+	},
+};
+
+#define NR_INSTANCES	(sizeof(instances) / sizeof(instances[0]))
+
+/*
+ * The ring buffer page header, from events/header_page.
+ */
+static struct event_field page_timestamp;
+static struct event_field page_commit;
+static struct event_field page_data;
+
+static char *page;
+
+static int write_instance_file(struct ftrace_instance *instance, const char *file,
+			       const char *value)
+{
+	char path[MAX_PATH];
+
+	snprintf(path, sizeof(path), "instances/%s/%s", instance->name, file);
+
+	return write_tracefs_file(path, value);
+}
+
+/*
+ * Build a tracing_cpumask: comma-separated 32-bit hex words, the highest
+ * CPUs first.
+ */
+static char *build_cpumask(int all_cpus)
+{
+	int nr_words = (config_nr_cpus + 31) / 32;
+	int size = nr_words * 9 + 1;
+	int position = 0;
+	uint32_t word;
+	char *mask;
+	int bit, cpu;
+	int i;
+
+	mask = allocate_memory(size, sizeof(*mask));
+
+	for (i = nr_words - 1; i >= 0; i--) {
+		word = 0;
+		for (bit = 0; bit < 32; bit++) {
+			cpu = i * 32 + bit;
+			if (cpu < config_nr_cpus
+			    && (all_cpus || cpumask_test_cpu(cpu, &config_monitored_cpus)))
+				word |= 1U << bit;
+		}
+
+		position += snprintf(mask + position, size - position, "%s%08x",
+				     position ? "," : "", word);
+	}
+
+	return mask;
+}
+
+static uint64_t read_page_field(char *buffer, struct event_field *field)
+{
+	if (field->size == 8)
+		return *(uint64_t *) (buffer + field->offset);
+
+	return *(uint32_t *) (buffer + field->offset);
+}
+
+/*
+ * Decode the events of a ring buffer page, as defined by the kernel's
+ * kernel/trace/ring_buffer.c.
+ */
+static void decode_page(int cpu, char *buffer, int size)
+{
+	uint32_t header, type_len, delta, length;
+	unsigned long commit;
+	char *ptr, *end;
+	uint64_t ts;
+
+	if (size <= page_data.offset)
+		return;
+
+	ts = read_page_field(buffer, &page_timestamp);
+	commit = read_page_field(buffer, &page_commit);
+
+	if (commit & RB_MISSED_EVENTS)
+		sched_events_lost();
+
+	length = commit & ~(RB_MISSED_EVENTS | RB_MISSED_STORED);
+	if (length > size - page_data.offset)
+		length = size - page_data.offset;
+
+	ptr = buffer + page_data.offset;
+	end = ptr + length;
+
+	while (ptr + sizeof(header) <= end) {
+		header = *(uint32_t *) ptr;
+		ptr += sizeof(header);
+
+		type_len = RB_TYPE_LEN(header);
+		delta = RB_TIME_DELTA(header);
+
+		switch (type_len) {
+		case RB_TYPE_PADDING:
+			/* The rest of the page was discarded. */
+			if (!delta || ptr + sizeof(uint32_t) > end)
+				return;
+			ptr += *(uint32_t *) ptr;
+			break;
+		case RB_TYPE_TIME_EXTEND:
+			if (ptr + sizeof(uint32_t) > end)
+				return;
+			ts += ((uint64_t) *(uint32_t *) ptr << RB_TS_SHIFT) + delta;
+			ptr += sizeof(uint32_t);
+			break;
+		case RB_TYPE_TIME_STAMP:
+			if (ptr + sizeof(uint32_t) > end)
+				return;
+			ts = ((uint64_t) *(uint32_t *) ptr << RB_TS_SHIFT) | delta;
+			ptr += sizeof(uint32_t);
+			break;
+		case 0:
+			/* The length, including itself, is in array[0]. */
+			if (ptr + sizeof(uint32_t) > end)
+				return;
+			length = *(uint32_t *) ptr - sizeof(uint32_t);
+			ptr += sizeof(uint32_t);
+			ts += delta;
+			if (ptr + length > end)
+				return;
+			sched_events_record(cpu, ts, ptr, length);
+			ptr += (length + 3) & ~3;
+			break;
+		default:
+			length = type_len * 4;
+			ts += delta;
+			if (ptr + length > end)
+				return;
+			sched_events_record(cpu, ts, ptr, length);
+			ptr += length;
+			break;
+		}
+	}
+}
+
+static void drain_cpu(struct ftrace_cpu *fcpu)
+{
+	ssize_t size;
+	int pages;
+
+	/* The full pages. */
+	for (pages = 0; pages < FTRACE_MAX_DRAIN_PAGES; pages++) {
+		size = splice(fcpu->fd, NULL, fcpu->pipe[1], NULL, page_size,
+			      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (size <= 0)
+			break;
+
+		size = read(fcpu->pipe[0], page, page_size);
+		if (size > 0)
+			decode_page(fcpu->cpu, page, size);
+	}
+
+	/* The events already committed to the page being written. */
+	for (; pages < FTRACE_MAX_DRAIN_PAGES; pages++) {
+		size = read(fcpu->fd, page, page_size);
+		if (size <= 0)
+			break;
+
+		decode_page(fcpu->cpu, page, size);
+	}
+}
+
+static void ftrace_track_drain(void)
+{
+	struct ftrace_instance *instance;
+	int i, cpu;
+
+	for (i = 0; i < NR_INSTANCES; i++) {
+		instance = &instances[i];
+		for (cpu = 0; cpu < instance->nr_cpus; cpu++)
+			drain_cpu(&instance->cpus[cpu]);
+	}
+}
+
+static int setup_instance(struct ftrace_instance *instance)
+{
+	struct ftrace_cpu *fcpu;
+	char path[MAX_PATH];
+	char file[MAX_FILE_NAME];
+	char *cpumask;
+	char *filter;
+	int cpu, fd;
+	int retval;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/instances/%s", tracefs_path, instance->name);
+	/*
+	 * An instance already there belongs to another stalld, or was left
+	 * by one that died: it is neither shared nor removed.
+	 */
+	if (mkdir(path, 0700)) {
+		if (errno == EEXIST)
+			warn("%s already exists, remove it if no other stalld runs\n", path);
+		else
+			warn("cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	instance->created = 1;
+
+	/* The events of all CPUs are sorted by this clock. */
+	if (write_instance_file(instance, "trace_clock", "mono")) {
+		warn("cannot set the mono trace clock\n");
+		return -1;
+	}
+
+	if (write_instance_file(instance, "buffer_size_kb", FTRACE_BUFFER_SIZE_KB))
+		log_msg("cannot set the %s buffer size, using the default\n", instance->name);
+
+	/* Wake up the event loop when a buffer is half full. */
+	if (write_instance_file(instance, "buffer_percent", FTRACE_BUFFER_PERCENT))
+		log_msg("cannot set the %s buffer_percent, using the default\n", instance->name);
+
+	cpumask = build_cpumask(instance->all_cpus);
+	retval = write_instance_file(instance, "tracing_cpumask", cpumask);
+	free(cpumask);
+	if (retval) {
+		warn("cannot set the %s tracing_cpumask\n", instance->name);
+		return -1;
+	}
+
+	for (i = 0; i < instance->nr_events; i++) {
+		filter = sched_event_cpu_filter(instance->events[i]);
+		if (filter) {
+			snprintf(file, sizeof(file), "events/sched/%s/filter",
+				 sched_event_name(instance->events[i]));
+			if (write_instance_file(instance, file, filter))
+				log_msg("cannot set the %s filter, filtering in user-space\n",
+					sched_event_name(instance->events[i]));
+			free(filter);
+		}
+
+		snprintf(file, sizeof(file), "events/sched/%s/enable",
+			 sched_event_name(instance->events[i]));
+		if (write_instance_file(instance, file, "1")) {
+			warn("cannot enable %s\n", sched_event_name(instance->events[i]));
+			return -1;
+		}
+	}
+
+	instance->cpus = allocate_memory(config_nr_cpus, sizeof(struct ftrace_cpu));
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++) {
+		if (!instance->all_cpus && !cpumask_test_cpu(cpu, &config_monitored_cpus))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/instances/%s/per_cpu/cpu%d/trace_pipe_raw",
+			 tracefs_path, instance->name, cpu);
+
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0)
+			continue; /* Not a possible CPU. */
+
+		fcpu = &instance->cpus[instance->nr_cpus++];
+		fcpu->cpu = cpu;
+		fcpu->fd = fd;
+		sched_events_add_fd(fd);
+
+		if (pipe2(fcpu->pipe, O_NONBLOCK)) {
+			warn("cannot create a pipe: %s\n", strerror(errno));
+			fcpu->pipe[0] = fcpu->pipe[1] = -1;
+			return -1;
+		}
+	}
+
+	if (write_instance_file(instance, "tracing_on", "1")) {
+		warn("cannot turn %s tracing on\n", instance->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void destroy_instance(struct ftrace_instance *instance)
+{
+	struct ftrace_cpu *fcpu;
+	char path[MAX_PATH];
+	int cpu;
+
+	for (cpu = 0; cpu < instance->nr_cpus; cpu++) {
+		fcpu = &instance->cpus[cpu];
+		close(fcpu->fd);
+		if (fcpu->pipe[0] >= 0) {
+			close(fcpu->pipe[0]);
+			close(fcpu->pipe[1]);
+		}
+	}
+
+	free(instance->cpus);
+	instance->cpus = NULL;
+	instance->nr_cpus = 0;
+
+	if (!instance->created)
+		return;
+
+	/* Removing the instance disables its events. */
+	snprintf(path, sizeof(path), "%s/instances/%s", tracefs_path, instance->name);
+	if (rmdir(path))
+		warn("cannot remove %s: %s\n", path, strerror(errno));
+
+	instance->created = 0;
+}
+
+static void ftrace_track_destroy(void)
+{
+	int i;
+
+	sched_events_destroy();
+
+	for (i = 0; i < NR_INSTANCES; i++)
+		destroy_instance(&instances[i]);
+
+	free(page);
+	page = NULL;
+}
+
+static int ftrace_track_init(void)
+{
+	char header_page[4096];
+	int i;
+
+	if (sched_events_init())
+		goto out_destroy;
+
+	if (read_tracefs_file("events/header_page", header_page, sizeof(header_page)) <= 0
+	    || find_event_field(header_page, "timestamp", &page_timestamp)
+	    || find_event_field(header_page, "commit", &page_commit)
+	    || find_event_field(header_page, "data", &page_data)) {
+		warn("cannot read the ring buffer page header\n");
+		goto out_destroy;
+	}
+
+	page = allocate_memory(page_size, sizeof(*page));
+
+	for (i = 0; i < NR_INSTANCES; i++)
+		if (setup_instance(&instances[i]))
+			goto out_destroy;
+
+	if (sched_events_start(ftrace_track_drain))
+		goto out_destroy;
+
+	log_msg("tracking the run-queues with the %s/instances/%s ftrace instance\n",
+		tracefs_path, instances[0].name);
+
+	return 0;
+
+out_destroy:
+	ftrace_track_destroy();
+	return -1;
+}
+
+struct stalld_backend ftrace_track_backend = {
+	.init			= ftrace_track_init,
+	.get			= sched_events_get,
+	.get_cpu		= sched_events_get_cpu,
+	.parse			= sched_events_parse,
+	.has_starving_task	= sched_events_has_starving_task,
+	.event_fds		= sched_events_event_fds,
+	.process_events		= sched_events_process,
+	.destroy		= ftrace_track_destroy,
+};
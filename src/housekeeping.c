@@ -0,0 +1,143 @@
+/*
+ * Housekeeping CPU detection: stalld runs on the CPUs the system keeps
+ * for housekeeping, and monitors the isolated ones, as set up with the
+ * isolcpus= and nohz_full= boot parameters, or with the isolated cpuset
+ * partitions of cgroup v2.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stalld.h"
+
+#define CGROUP_ROOT	"/sys/fs/cgroup"
+
+/*
+ * The CPUs found isolated, for the nftw() callback.
+ */
+static struct cpumask isolated_cpus;
+
+static int read_cpu_list_file(const char *path, struct cpumask *mask)
+{
+	int retval;
+
+	/* nohz_full reads "(null)" when it is not set. */
+	retval = cpumask_read(mask, path);
+	if (retval > 0)
+		log_msg("housekeeping: %s: %d cpus\n", path, retval);
+
+	return retval;
+}
+
+/*
+ * Add the CPUs of the isolated cpuset partitions.
+ */
+static int check_partition(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	char file[PATH_MAX];
+	char partition[64];
+	int retval;
+	int fd;
+
+	if (type != FTW_D)
+		return 0;
+
+	snprintf(file, sizeof(file), "%s/cpuset.cpus.partition", path);
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	retval = read(fd, partition, sizeof(partition) - 1);
+	close(fd);
+
+	if (retval <= 0)
+		return 0;
+
+	partition[retval] = '\0';
+	partition[strcspn(partition, "\n")] = '\0';
+
+	/* Not "isolated invalid (...)": the kernel did not isolate them. */
+	if (strcmp(partition, "isolated"))
+		return 0;
+
+	snprintf(file, sizeof(file), "%s/cpuset.cpus.effective", path);
+	read_cpu_list_file(file, &isolated_cpus);
+
+	return 0;
+}
+
+/*
+ * Run stalld on the housekeeping CPUs and monitor the isolated ones,
+ * unless set with -a and -c. Returns 0 on success, -1 if no CPU is
+ * isolated, leaving the defaults.
+ */
+int setup_housekeeping(void)
+{
+	struct cpumask online;
+	cpu_set_t set;
+	int nr_isolated = 0;
+	int nr_housekeeping = 0;
+	int cpu;
+
+	cpumask_init(&isolated_cpus, config_nr_cpus);
+	cpumask_init(&online, config_nr_cpus);
+
+	read_cpu_list_file("/sys/devices/system/cpu/isolated", &isolated_cpus);
+	read_cpu_list_file("/sys/devices/system/cpu/nohz_full", &isolated_cpus);
+	nftw(CGROUP_ROOT, check_partition, 16, FTW_PHYS | FTW_MOUNT);
+
+	if (!cpumask_read(&online, "/sys/devices/system/cpu/online"))
+		cpumask_setall(&online);
+
+	CPU_ZERO(&set);
+	for_each_cpu(cpu, &online) {
+		if (cpu >= CPU_SETSIZE)
+			break;
+
+		if (cpumask_test_cpu(cpu, &isolated_cpus)) {
+			nr_isolated++;
+		} else {
+			CPU_SET(cpu, &set);
+			nr_housekeeping++;
+		}
+	}
+
+	cpumask_destroy(&online);
+
+	if (!nr_isolated || !nr_housekeeping) {
+		log_msg("housekeeping: no isolated cpus found, keeping the defaults\n");
+		cpumask_destroy(&isolated_cpus);
+		return -1;
+	}
+
+	log_msg("housekeeping: %d isolated cpus, %d housekeeping cpus\n",
+		nr_isolated, nr_housekeeping);
+
+	/* The explicit -c and -a win. */
+	if (config_monitor_all_cpus) {
+		config_monitor_all_cpus = 0;
+		config_monitored_cpus = isolated_cpus;
+	} else {
+		cpumask_destroy(&isolated_cpus);
+	}
+	memset(&isolated_cpus, 0, sizeof(isolated_cpus));
+
+	if (!config_affinity_cpus && sched_setaffinity(0, sizeof(set), &set)) {
+		warn("housekeeping: cannot set the affinity: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
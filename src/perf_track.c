@@ -0,0 +1,365 @@
+/*
+ * perf_track backend: tracks the run-queues with the sched tracepoints
+ * opened with perf_event_open(), for systems without BPF and without
+ * debugfs.
+ *
+ * Like ftrace_track, sched_switch is only opened on the monitored CPUs,
+ * and the wakeups and migrations on all CPUs, filtered by the target CPU.
+ * All the events of a CPU share one mmap'd ring buffer, from which the
+ * raw samples are read. tracefs is only read at init, for the event ids
+ * and formats. The events of the CPUs are opened and closed as the CPUs
+ * go online and offline.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+
+#include "stalld.h"
+#include "sched_events.h"
+
+/*
+ * Data pages of each per-CPU ring buffer, a power of 2.
+ */
+#define PERF_RING_PAGES		256
+
+#define PERF_SAMPLE_TYPE	(PERF_SAMPLE_TIME | PERF_SAMPLE_CPU | PERF_SAMPLE_RAW)
+
+struct perf_cpu {
+	int cpu;
+	int monitored;		/* with sched_switch */
+	int nr_fds;
+	int fds[NR_SCHED_EVENTS];
+	struct perf_event_mmap_page *ring;
+};
+
+/*
+ * The PERF_SAMPLE_TYPE sample, after the header.
+ */
+struct perf_sample {
+	uint64_t time;
+	uint32_t cpu;
+	uint32_t reserved;
+	uint32_t raw_size;
+	char raw[];
+};
+
+/*
+ * Indexed by CPU, the ones with a ring are traced. The drain and the CPU
+ * hotplug run in different threads.
+ */
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct perf_cpu *perf_cpus;
+static size_t ring_size;
+static char *record;
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+			   int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static void perf_read_record(struct perf_cpu *pcpu, uint64_t tail, int size)
+{
+	char *data = (char *) pcpu->ring + page_size;
+	uint64_t offset = tail & (ring_size - 1);
+
+	/* A record can wrap around the end of the ring. */
+	if (offset + size <= ring_size) {
+		memcpy(record, data + offset, size);
+	} else {
+		memcpy(record, data + offset, ring_size - offset);
+		memcpy(record + ring_size - offset, data, size - (ring_size - offset));
+	}
+}
+
+static void drain_cpu(struct perf_cpu *pcpu)
+{
+	struct perf_event_mmap_page *ring = pcpu->ring;
+	struct perf_event_header *header;
+	struct perf_sample *sample;
+	uint64_t head, tail;
+
+	head = __atomic_load_n(&ring->data_head, __ATOMIC_ACQUIRE);
+	tail = ring->data_tail;
+
+	while (tail < head) {
+		header = (struct perf_event_header *) ((char *) ring + page_size
+						       + (tail & (ring_size - 1)));
+
+		perf_read_record(pcpu, tail, header->size);
+		header = (struct perf_event_header *) record;
+
+		switch (header->type) {
+		case PERF_RECORD_SAMPLE:
+			sample = (struct perf_sample *) (header + 1);
+			sched_events_record(sample->cpu, sample->time, sample->raw, sample->raw_size);
+			break;
+		case PERF_RECORD_LOST:
+			sched_events_lost();
+			break;
+		}
+
+		tail += header->size;
+	}
+
+	__atomic_store_n(&ring->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void perf_track_drain(void)
+{
+	int i;
+
+	pthread_mutex_lock(&perf_lock);
+	for (i = 0; i < config_nr_cpus; i++)
+		if (perf_cpus[i].ring)
+			drain_cpu(&perf_cpus[i]);
+	pthread_mutex_unlock(&perf_lock);
+}
+
+/*
+ * Open an event on the CPU. The first one owns the CPU's ring buffer, the
+ * others write their samples to it.
+ *
+ * Returns 0 on success, 1 if the CPU is not available, -1 on error.
+ */
+static int open_cpu_event(struct perf_cpu *pcpu, enum sched_event_type type)
+{
+	struct perf_event_attr attr;
+	char *filter;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.config = sched_event_id(type);
+	attr.sample_period = 1;
+	attr.sample_type = PERF_SAMPLE_TYPE;
+	attr.disabled = 1;
+	/* Wake up the event loop when the ring is half full. */
+	attr.watermark = 1;
+	attr.wakeup_watermark = ring_size / 2;
+	/* The events of all CPUs are sorted by this clock. */
+	attr.use_clockid = 1;
+	attr.clockid = CLOCK_MONOTONIC;
+
+	fd = perf_event_open(&attr, -1, pcpu->cpu, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENODEV)
+			return 1;
+		warn("cannot open %s on cpu %d: %s\n", sched_event_name(type), pcpu->cpu,
+		     strerror(errno));
+		return -1;
+	}
+
+	pcpu->fds[pcpu->nr_fds++] = fd;
+
+	filter = sched_event_cpu_filter(type);
+	if (filter) {
+		if (ioctl(fd, PERF_EVENT_IOC_SET_FILTER, filter))
+			log_verbose("cannot set the %s filter, filtering in user-space\n",
+				    sched_event_name(type));
+		free(filter);
+	}
+
+	if (!pcpu->ring) {
+		pcpu->ring = mmap(NULL, page_size + ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED, fd, 0);
+		if (pcpu->ring == MAP_FAILED) {
+			pcpu->ring = NULL;
+			warn("cannot map the cpu %d ring buffer: %s\n", pcpu->cpu, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, pcpu->fds[0])) {
+		warn("cannot redirect %s on cpu %d: %s\n", sched_event_name(type), pcpu->cpu,
+		     strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int open_cpu_events(struct perf_cpu *pcpu)
+{
+	int retval;
+
+	if (should_monitor(pcpu->cpu)) {
+		retval = open_cpu_event(pcpu, SCHED_SWITCH);
+		if (retval)
+			return retval;
+	}
+
+	retval = open_cpu_event(pcpu, SCHED_WAKEUP);
+	if (!retval)
+		retval = open_cpu_event(pcpu, SCHED_WAKEUP_NEW);
+	if (!retval)
+		retval = open_cpu_event(pcpu, SCHED_MIGRATE_TASK);
+
+	return retval;
+}
+
+static void close_cpu_events(struct perf_cpu *pcpu)
+{
+	int i;
+
+	if (pcpu->ring)
+		munmap(pcpu->ring, page_size + ring_size);
+
+	for (i = 0; i < pcpu->nr_fds; i++)
+		close(pcpu->fds[i]);
+
+	pcpu->ring = NULL;
+	pcpu->nr_fds = 0;
+}
+
+/*
+ * Open the events of the CPU, and wait for its ring. With enable, the
+ * events start right away, otherwise perf_track_init() starts them all
+ * at once.
+ *
+ * Returns 0 on success, 1 if the CPU is not online, -1 on error.
+ */
+static int start_cpu(struct perf_cpu *pcpu, int enable)
+{
+	int retval;
+	int i;
+
+	retval = open_cpu_events(pcpu);
+	if (retval) {
+		close_cpu_events(pcpu);
+		return retval;
+	}
+
+	pcpu->monitored = should_monitor(pcpu->cpu);
+	sched_events_add_fd(pcpu->fds[0]);
+
+	if (enable)
+		for (i = 0; i < pcpu->nr_fds; i++)
+			ioctl(pcpu->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+
+	return 0;
+}
+
+static void stop_cpu(struct perf_cpu *pcpu)
+{
+	if (!pcpu->ring)
+		return;
+
+	sched_events_remove_fd(pcpu->fds[0]);
+	close_cpu_events(pcpu);
+}
+
+/*
+ * A monitored CPU went online or offline: trace the online CPUs, with
+ * sched_switch on the monitored ones. The CPUs that are not monitored
+ * are synced too, their wakeups and migrations target the monitored ones.
+ * The events missed meanwhile are made up by rebuilding the run-queues.
+ */
+static void perf_track_set_cpu_monitoring(int cpu, int monitor)
+{
+	struct perf_cpu *pcpu;
+	int online;
+	int i;
+
+	pthread_mutex_lock(&perf_lock);
+
+	for (i = 0; i < config_nr_cpus; i++) {
+		pcpu = &perf_cpus[i];
+		online = cpumask_test_cpu(i, &online_cpus);
+
+		if (pcpu->ring && (!online || pcpu->monitored != should_monitor(i)))
+			stop_cpu(pcpu);
+
+		if (online && !pcpu->ring && start_cpu(pcpu, 1) < 0)
+			warn("cannot trace cpu %d\n", i);
+	}
+
+	pthread_mutex_unlock(&perf_lock);
+
+	sched_events_lost();
+}
+
+static void perf_track_destroy(void)
+{
+	int i;
+
+	sched_events_destroy();
+
+	if (perf_cpus)
+		for (i = 0; i < config_nr_cpus; i++)
+			close_cpu_events(&perf_cpus[i]);
+
+	free(perf_cpus);
+	perf_cpus = NULL;
+
+	free(record);
+	record = NULL;
+}
+
+static int perf_track_init(void)
+{
+	int nr_perf_cpus = 0;
+	int retval;
+	int cpu;
+	int i;
+
+	if (sched_events_init())
+		goto out_destroy;
+
+	ring_size = PERF_RING_PAGES * page_size;
+	record = allocate_memory(1, UINT16_MAX + 1);
+	perf_cpus = allocate_memory(config_nr_cpus, sizeof(struct perf_cpu));
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++) {
+		perf_cpus[cpu].cpu = cpu;
+
+		retval = start_cpu(&perf_cpus[cpu], 0);
+		if (retval < 0)
+			goto out_destroy;
+		if (!retval)
+			nr_perf_cpus++;
+	}
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++)
+		for (i = 0; i < perf_cpus[cpu].nr_fds; i++)
+			ioctl(perf_cpus[cpu].fds[i], PERF_EVENT_IOC_ENABLE, 0);
+
+	if (sched_events_start(perf_track_drain))
+		goto out_destroy;
+
+	log_msg("tracking the run-queues with perf events on %d cpus\n", nr_perf_cpus);
+
+	return 0;
+
+out_destroy:
+	perf_track_destroy();
+	return -1;
+}
+
+struct stalld_backend perf_track_backend = {
+	.init			= perf_track_init,
+	.get			= sched_events_get,
+	.get_cpu		= sched_events_get_cpu,
+	.parse			= sched_events_parse,
+	.has_starving_task	= sched_events_has_starving_task,
+	.event_fds		= sched_events_event_fds,
+	.process_events		= sched_events_process,
+	.set_cpu_monitoring	= perf_track_set_cpu_monitoring,
+	.destroy		= perf_track_destroy,
+};
@@ -147,7 +147,11 @@ static int queue_track_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 	struct queued_task *qtask;
 	int retval = 0;
 
-	tasks = allocate_memory(MAX_QUEUE_TASK, sizeof(struct task_info));
+	for_each_queued_task(cpu_data, qtask)
+		nr_running++;
+
+	tasks = get_task_array(cpu_info, nr_running);
+	nr_running = 0;
 
 	for_each_queued_task(cpu_data, qtask) {
 		if (qtask->is_rt)
@@ -171,10 +175,12 @@ static int queue_track_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 
 		task->pid = qtask->pid;
 		task->tgid = qtask->tgid;
+		task->prio = qtask->prio;
 
 		task->ctxsw = qtask->ctxswc;
+		task->runtime = 0;
 
-		task->since = time(NULL);
+		task->since = get_time_ns();
 
 		nr_running++;
 
@@ -189,10 +195,8 @@ static int queue_track_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 	if (cpu_info->nr_running >= 1)
 		cpu_info->nr_waiting_tasks = nr_running - 1;
 
-	if (old_tasks) {
+	if (old_tasks)
 		merge_taks_info(cpu_info->id, old_tasks, nr_old_tasks, cpu_info->starving, cpu_info->nr_waiting_tasks);
-                free(old_tasks);
-        }
 
 	return 0;
 }
@@ -220,7 +224,7 @@ static int initialize_maps(void)
 		if (get_cpu_data(&stalld_data, i))
 			return -1;
 
-		if (config_monitor_all_cpus || config_monitored_cpus[i])
+		if (should_monitor(i))
 			stalld_data.monitoring = 1;
 
 		set_cpu_data(&stalld_data, i);
@@ -352,6 +356,20 @@ destroy:
 	return -1;
 }
 
+/*
+ * Start or stop the tracking of a CPU that came online or went offline.
+ */
+static void queue_track_set_cpu_monitoring(int cpu, int monitor)
+{
+	struct stalld_cpu_data stalld_data;
+
+	if (get_cpu_data(&stalld_data, cpu))
+		return;
+
+	stalld_data.monitoring = monitor;
+	set_cpu_data(&stalld_data, cpu);
+}
+
 static void queue_track_destroy(void)
 {
 	struct stalld_cpu_data stalld_data;
@@ -374,6 +392,7 @@ struct stalld_backend queue_track_backend = {
 	.get_cpu		= queue_track_get_cpu,
 	.parse			= queue_track_parse,
 	.has_starving_task	= queue_track_has_starving_task,
+	.set_cpu_monitoring	= queue_track_set_cpu_monitoring,
 	.destroy		= queue_track_destroy,
 };
 #endif /* USE_BPF */
@@ -0,0 +1,141 @@
+/*
+ * Replay backend: feeds recorded sched_debug snapshots to the sched_debug
+ * parser, so it can be tested and measured without the machine that
+ * produced them.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "sched_debug.h"
+
+/*
+ * A sched_debug snapshot file, or a directory of snapshot files that are
+ * replayed in alphabetical order, wrapping around at the end.
+ */
+char *config_replay_path;
+
+static char **snapshots;
+static int nr_snapshots;
+static unsigned int next_snapshot;
+
+static int snapshot_filter(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+static void add_snapshot(const char *dir, const char *name)
+{
+	size_t size;
+	char *path;
+
+	snapshots = realloc(snapshots, (nr_snapshots + 1) * sizeof(*snapshots));
+	if (!snapshots)
+		die("Cannot allocate memory");
+
+	size = strlen(dir) + strlen(name) + 2;
+	path = allocate_memory(size, sizeof(*path));
+	if (name[0])
+		snprintf(path, size, "%s/%s", dir, name);
+	else
+		snprintf(path, size, "%s", dir);
+
+	snapshots[nr_snapshots++] = path;
+}
+
+static int replay_init(void)
+{
+	struct dirent **entries;
+	struct stat st;
+	int nr_entries;
+	int i;
+
+	if (!config_replay_path)
+		die("the replay backend needs a snapshot path\n");
+
+	if (stat(config_replay_path, &st))
+		die("cannot stat %s: %s\n", config_replay_path, strerror(errno));
+
+	if (S_ISDIR(st.st_mode)) {
+		nr_entries = scandir(config_replay_path, &entries, snapshot_filter, alphasort);
+		if (nr_entries < 0)
+			die("cannot read %s: %s\n", config_replay_path, strerror(errno));
+
+		for (i = 0; i < nr_entries; i++) {
+			add_snapshot(config_replay_path, entries[i]->d_name);
+			free(entries[i]);
+		}
+		free(entries);
+	} else {
+		add_snapshot(config_replay_path, "");
+	}
+
+	if (!nr_snapshots)
+		die("no sched_debug snapshots found in %s\n", config_replay_path);
+
+	log_msg("replaying %d sched_debug snapshot(s) from %s\n", nr_snapshots,
+		config_replay_path);
+
+	/*
+	 * The task format and the initial buffer size are detected from
+	 * the first snapshot, as if it was the live sched_debug file.
+	 */
+	next_snapshot = 0;
+	config_sched_debug_path = snapshots[0];
+
+	return sched_debug_backend.init();
+}
+
+static int replay_get(char *buffer, int size)
+{
+	unsigned int snapshot;
+
+	/* Per-CPU threads share the replay cursor. */
+	snapshot = __atomic_fetch_add(&next_snapshot, 1, __ATOMIC_RELAXED);
+
+	return read_sched_debug(snapshots[snapshot % nr_snapshots], buffer, size);
+}
+
+static int replay_parse(struct cpu_info *cpu_info, char *buffer, size_t buffer_size)
+{
+	return sched_debug_backend.parse(cpu_info, buffer, buffer_size);
+}
+
+static int replay_has_starving_task(struct cpu_info *cpu)
+{
+	return sched_debug_backend.has_starving_task(cpu);
+}
+
+static void replay_destroy(void)
+{
+	int i;
+
+	sched_debug_backend.destroy();
+
+	for (i = 0; i < nr_snapshots; i++)
+		free(snapshots[i]);
+	free(snapshots);
+
+	snapshots = NULL;
+	nr_snapshots = 0;
+	config_sched_debug_path = NULL;
+}
+
+struct stalld_backend replay_backend = {
+	.init			= replay_init,
+	.get			= replay_get,
+	.parse			= replay_parse,
+	.has_starving_task	= replay_has_starving_task,
+	.destroy		= replay_destroy,
+};
@@ -28,15 +28,15 @@ static struct task_format_offsets
     config_task_format_offsets  = { 0, 0, 0, 0 };
 
 /*
- * Read the contents of sched_debug into the input buffer.
+ * Read the contents of a sched_debug file at path into the input buffer.
  */
-static int sched_debug_get(char *buffer, int size)
+int read_sched_debug(const char *path, char *buffer, int size)
 {
 	int position = 0;
 	int retval;
 	int fd;
 
-	fd = open(config_sched_debug_path, O_RDONLY);
+	fd = open(path, O_RDONLY);
 
 	if (fd < 0)
 		goto out_error;
@@ -68,6 +68,14 @@ out_error:
 	return 0;
 }
 
+/*
+ * Read the contents of sched_debug into the input buffer.
+ */
+static int sched_debug_get(char *buffer, int size)
+{
+	return read_sched_debug(config_sched_debug_path, buffer, size);
+}
+
 /*
  * Find the start of a CPU information block in the input buffer.
  */
@@ -101,10 +109,22 @@ static char *get_next_cpu_info_start(char *start)
 	return strstr(start, next_cpu);
 }
 
-static char *alloc_and_fill_cpu_buffer(int cpu, char *sched_dbg, int sched_dbg_size)
+/*
+ * The section of each CPU is copied to a buffer of its own, kept from a
+ * parse to the next: the snapshot is shared by the monitors, and a CPU is
+ * parsed by a single one at a time.
+ */
+struct cpu_buffer {
+	char *buffer;
+	int size;
+};
+
+static struct cpu_buffer *cpu_buffers;
+
+static char *fill_cpu_buffer(int cpu, char *sched_dbg, int sched_dbg_size)
 {
+	struct cpu_buffer *cpu_buffer = &cpu_buffers[cpu];
 	char *next_cpu_start;
-	char *cpu_buffer;
 	char *cpu_start;
 	int size = 0;
 
@@ -128,16 +148,21 @@ static char *alloc_and_fill_cpu_buffer(int cpu, char *sched_dbg, int sched_dbg_s
 	if (size <= 0)
 		return NULL;
 
-	cpu_buffer = malloc(size);
-
-	if (!cpu_buffer)
-		return NULL;
+	if (size > cpu_buffer->size) {
+		free(cpu_buffer->buffer);
+		cpu_buffer->buffer = malloc(size);
+		if (!cpu_buffer->buffer) {
+			cpu_buffer->size = 0;
+			return NULL;
+		}
+		cpu_buffer->size = size;
+	}
 
-	strncpy(cpu_buffer, cpu_start, size);
+	memcpy(cpu_buffer->buffer, cpu_start, size - 1);
 
-	cpu_buffer[size-1] = '\0';
+	cpu_buffer->buffer[size-1] = '\0';
 
-	return cpu_buffer;
+	return cpu_buffer->buffer;
 }
 
 /*
@@ -239,7 +264,12 @@ static int detect_task_format(void)
 
 	/* move to the column header line */
 	ptr = nextline(ptr);
-	i = 0;
+
+	/*
+	 * Word offsets are 1-based, see skip2word(). The 'S' column of the
+	 * new format is counted by the header walk below like any other word.
+	 */
+	i = 1;
 
 	/*
 	 * Determine the TASK_FORMAT from the first "word" in the header
@@ -249,8 +279,6 @@ static int detect_task_format(void)
 	if (strncmp(ptr, "S", strlen("S")) == 0) {
 		log_msg("detect_task_format: NEW_TASK_FORMAT detected\n");
 		retval = NEW_TASK_FORMAT;
-		/* move the word offset by one */
-		i++;
 	}
 	else {
 		log_msg("detect_task_format: OLD_TASK_FORMAT detected\n");
@@ -476,8 +504,9 @@ static int parse_task_lines(char *buffer, struct task_info *task_info, int nr_en
 			task->pid = pid;
 			task->tgid = get_tgid(task->pid);
 			task->ctxsw = ctxsw;
+			task->runtime = 0;
 			task->prio = prio;
-			task->since = time(NULL);
+			task->since = get_time_ns();
 			/* increment the count of tasks processed */
 			tasks++;
 		}
@@ -539,11 +568,7 @@ static int fill_waiting_task(char *buffer, struct cpu_info *cpu_info)
 		return 0;
 	}
 
-	cpu_info->starving = malloc(sizeof(struct task_info) * nr_entries);
-	if (cpu_info->starving == NULL) {
-		warn("failed to malloc %d task_info structs", nr_entries);
-		return 0;
-	}
+	cpu_info->starving = get_task_array(cpu_info, nr_entries);
 
 	nr_waiting = parse_task_lines(buffer, cpu_info->starving, nr_entries);
 
@@ -560,14 +585,12 @@ static int sched_debug_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 	char *cpu_buffer;
 	int retval = 0;
 
-	cpu_buffer = alloc_and_fill_cpu_buffer(cpu, buffer, buffer_size);
+	cpu_buffer = fill_cpu_buffer(cpu, buffer, buffer_size);
 	/*
 	 * It is not necessarily a problem, the CPU might be offline. Cleanup
 	 * and leave.
 	 */
 	if (!cpu_buffer) {
-		if (old_tasks)
-			free(old_tasks);
 		cpu_info->nr_waiting_tasks = 0;
 		cpu_info->nr_running = 0;
 		cpu_info->nr_rt_running = 0;
@@ -585,7 +608,7 @@ static int sched_debug_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 		nr_rt_running = get_variable_long_value(cpu_buffer, ".rt_nr_running");
 		if ((nr_running == -1) || (nr_rt_running == -1)) {
 			retval = -EINVAL;
-			goto out_free;
+			goto out;
 		}
 	}
 
@@ -593,13 +616,9 @@ static int sched_debug_parse(struct cpu_info *cpu_info, char *buffer, size_t buf
 	cpu_info->nr_rt_running = nr_rt_running;
 
 	cpu_info->nr_waiting_tasks = fill_waiting_task(cpu_buffer, cpu_info);
-	if (old_tasks) {
+	if (old_tasks)
 		merge_taks_info(cpu_info->id, old_tasks, nr_old_tasks, cpu_info->starving, cpu_info->nr_waiting_tasks);
-		free(old_tasks);
-	}
 
-out_free:
-	free(cpu_buffer);
 out:
 	return retval;
 }
@@ -614,15 +633,27 @@ static int sched_debug_has_starving_task(struct cpu_info *cpu)
 
 static int sched_debug_init(void)
 {
-	find_sched_debug_path();
+	/* The replay backend points it to a recorded snapshot. */
+	if (!config_sched_debug_path && !find_sched_debug_path())
+		die("stalld could not find the sched_debug file.\n");
 	if ((config_task_format = detect_task_format()) == TASK_FORMAT_UNKNOWN)
 		die("Can't handle task format!\n");
+
+	cpu_buffers = allocate_memory(config_nr_cpus, sizeof(*cpu_buffers));
 	return 0;
 }
 
 static void sched_debug_destroy(void)
 {
-	return;
+	int cpu;
+
+	if (!cpu_buffers)
+		return;
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++)
+		free(cpu_buffers[cpu].buffer);
+	free(cpu_buffers);
+	cpu_buffers = NULL;
 }
 
 struct stalld_backend sched_debug_backend = {
@@ -64,4 +64,7 @@ struct task_format_offsets {
 	int wait_time;
 };
 
+int read_sched_debug(const char *path, char *buffer, int size);
+
 extern struct stalld_backend sched_debug_backend;
+extern struct stalld_backend replay_backend;
@@ -0,0 +1,843 @@
+/*
+ * Run-queue tracking from the sched tracepoints, without BPF.
+ *
+ * The event backends (ftrace_track and perf_track) only read raw
+ * tracepoint records from the kernel. This file decodes them using the
+ * tracefs format files, and rebuilds the run-queue of each monitored CPU
+ * in user-space, like the queue_track BPF program does in the kernel.
+ *
+ * Records come from per-CPU buffers, so they are sorted by timestamp
+ * before being applied: a wakeup recorded on a CPU must be applied before
+ * the sched_switch of the woken task on another CPU.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "event_loop.h"
+#include "sched_events.h"
+
+#define FORMAT_FILE_SIZE	8192
+#define MAX_EVENT_FIELDS	5
+
+/*
+ * A decoded record. For sched_switch, pid and prio are the prev task's.
+ * For sched_migrate_task, cpu is the origin CPU.
+ */
+struct sched_event {
+	uint64_t ts;
+	unsigned int seq;
+	int type;
+	int cpu;
+	int target_cpu;
+	int pid;
+	int prio;
+	long state;
+	int next_pid;
+	int next_prio;
+};
+
+static struct sched_event_format {
+	const char *name;
+	const char *fields[MAX_EVENT_FIELDS];
+	int id;
+	struct event_field field[MAX_EVENT_FIELDS];
+} formats[NR_SCHED_EVENTS] = {
+	[SCHED_SWITCH]		= { "sched_switch",
+				    { "prev_pid", "prev_prio", "prev_state", "next_pid", "next_prio" } },
+	[SCHED_WAKEUP]		= { "sched_wakeup", { "pid", "prio", "target_cpu" } },
+	[SCHED_WAKEUP_NEW]	= { "sched_wakeup_new", { "pid", "prio", "target_cpu" } },
+	[SCHED_MIGRATE_TASK]	= { "sched_migrate_task", { "pid", "prio", "orig_cpu", "dest_cpu" } },
+};
+
+static struct event_field common_type;
+
+char tracefs_path[MAX_DIR_PATH];
+
+/*
+ * The events are drained by the event loop of the main thread, and before
+ * each scan, while the per-CPU threads might be reading the run-queues.
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sched_events_cpu **cpu_queues;
+static int events_lost;
+
+static void (*drain_events)(void);
+static int *event_fds;
+static int nr_event_fds;
+static struct sched_event *pending;
+static int nr_pending;
+static int max_pending;
+static unsigned int event_seq;
+
+/*
+ * Changes whenever a task gets the CPU, or is woken up.
+ */
+static long progress_seq;
+
+int read_tracefs_file(const char *file, char *buffer, int size)
+{
+	char path[MAX_PATH];
+	int position = 0;
+	int retval;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", tracefs_path, file);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	do {
+		retval = read(fd, buffer + position, size - position - 1);
+		if (retval < 0) {
+			close(fd);
+			return -1;
+		}
+		position += retval;
+	} while (retval > 0 && position < size - 1);
+
+	buffer[position] = '\0';
+	close(fd);
+
+	return position;
+}
+
+int write_tracefs_file(const char *file, const char *value)
+{
+	char path[MAX_PATH];
+	int retval;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", tracefs_path, file);
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return -1;
+
+	retval = write(fd, value, strlen(value));
+	close(fd);
+
+	return retval < 0 ? -1 : 0;
+}
+
+/*
+ * Find a field in a tracefs format file. The lines look like:
+ *
+ * "	field:pid_t prev_pid;	offset:24;	size:4;	signed:1;"
+ * "	field:char next_comm[16];	offset:40;	size:16;	signed:0;"
+ */
+int find_event_field(const char *format, const char *name, struct event_field *field)
+{
+	const char *line, *decl, *end, *ident_end, *ident;
+	size_t name_len = strlen(name);
+
+	for (line = format; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+		decl = strstr(line, "field:");
+		if (!decl)
+			break;
+
+		end = strchr(decl, ';');
+		if (!end)
+			break;
+
+		line = decl;
+
+		/* Skip the array size, if any. */
+		ident_end = memchr(decl, '[', end - decl);
+		if (!ident_end)
+			ident_end = end;
+
+		ident = ident_end;
+		while (ident > decl && (isalnum(ident[-1]) || ident[-1] == '_'))
+			ident--;
+
+		if (ident_end - ident != name_len || strncmp(ident, name, name_len))
+			continue;
+
+		if (sscanf(end, "; offset:%d; size:%d;", &field->offset, &field->size) != 2)
+			return -EINVAL;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+const char *sched_event_name(enum sched_event_type type)
+{
+	return formats[type].name;
+}
+
+int sched_event_id(enum sched_event_type type)
+{
+	return formats[type].id;
+}
+
+/*
+ * Read the id and the fields of an event from tracefs.
+ */
+static int read_event_format(struct sched_event_format *format)
+{
+	char buffer[FORMAT_FILE_SIZE];
+	char file[MAX_FILE_NAME];
+	int i;
+
+	snprintf(file, sizeof(file), "events/sched/%s/id", format->name);
+	if (read_tracefs_file(file, buffer, sizeof(buffer)) <= 0)
+		return -1;
+	format->id = atoi(buffer);
+
+	snprintf(file, sizeof(file), "events/sched/%s/format", format->name);
+	if (read_tracefs_file(file, buffer, sizeof(buffer)) <= 0)
+		return -1;
+
+	if (find_event_field(buffer, "common_type", &common_type))
+		return -1;
+
+	for (i = 0; i < MAX_EVENT_FIELDS && format->fields[i]; i++) {
+		if (find_event_field(buffer, format->fields[i], &format->field[i])) {
+			warn("%s has no %s field\n", format->name, format->fields[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Build a filter for the events recorded on a CPU on behalf of another,
+ * so that only the ones about the monitored CPUs are recorded.
+ *
+ * Returns NULL if no filter is needed.
+ */
+char *sched_event_cpu_filter(enum sched_event_type type)
+{
+	const char *fields[2];
+	int nr_fields = 0;
+	size_t position = 0;
+	size_t size;
+	char *filter;
+	int first;
+	int cpu;
+	int i;
+
+	switch (type) {
+	case SCHED_WAKEUP:
+	case SCHED_WAKEUP_NEW:
+		fields[nr_fields++] = "target_cpu";
+		break;
+	case SCHED_MIGRATE_TASK:
+		fields[nr_fields++] = "orig_cpu";
+		fields[nr_fields++] = "dest_cpu";
+		break;
+	default:
+		return NULL;
+	}
+
+	if (config_monitor_all_cpus)
+		return NULL;
+
+	size = (config_nr_cpus + 1) * nr_fields * 64;
+	filter = allocate_memory(size, sizeof(*filter));
+
+	for (i = 0; i < nr_fields; i++) {
+		for_each_cpu(cpu, &config_monitored_cpus) {
+			first = cpu;
+			while (cpu + 1 < config_nr_cpus
+			       && cpumask_test_cpu(cpu + 1, &config_monitored_cpus))
+				cpu++;
+
+			position += snprintf(filter + position, size - position,
+					     "%s(%s>=%d&&%s<=%d)", position ? "||" : "",
+					     fields[i], first, fields[i], cpu);
+		}
+	}
+
+	/* The kernel does not take filters larger than a page. */
+	if (position >= page_size) {
+		log_msg("%s filter too long, filtering in user-space\n", sched_event_name(type));
+		free(filter);
+		return NULL;
+	}
+
+	return filter;
+}
+
+static long read_event_field(void *data, int size, struct event_field *field)
+{
+	char *ptr = (char *) data + field->offset;
+
+	if (field->offset + field->size > size)
+		return 0;
+
+	switch (field->size) {
+	case 1:
+		return *(int8_t *) ptr;
+	case 2:
+		return *(int16_t *) ptr;
+	case 4:
+		return *(int32_t *) ptr;
+	case 8:
+		return *(int64_t *) ptr;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode a raw tracepoint record, and queue it to be applied once all
+ * the buffers were read up to its timestamp.
+ */
+void sched_events_record(int cpu, uint64_t ts, void *data, int size)
+{
+	struct sched_event_format *format = NULL;
+	struct sched_event *event;
+	int id;
+	int i;
+
+	id = read_event_field(data, size, &common_type);
+	for (i = 0; i < NR_SCHED_EVENTS; i++) {
+		if (formats[i].id == id) {
+			format = &formats[i];
+			break;
+		}
+	}
+
+	if (!format)
+		return;
+
+	if (nr_pending == max_pending) {
+		max_pending = max_pending ? max_pending * 2 : 1024;
+		pending = realloc(pending, max_pending * sizeof(*pending));
+		if (!pending)
+			die("Cannot allocate memory");
+	}
+
+	event = &pending[nr_pending++];
+	memset(event, 0, sizeof(*event));
+	event->ts = ts;
+	event->seq = event_seq++;
+	event->type = i;
+	event->cpu = cpu;
+	event->pid = read_event_field(data, size, &format->field[0]);
+	event->prio = read_event_field(data, size, &format->field[1]);
+
+	switch (i) {
+	case SCHED_SWITCH:
+		event->state = read_event_field(data, size, &format->field[2]);
+		event->next_pid = read_event_field(data, size, &format->field[3]);
+		event->next_prio = read_event_field(data, size, &format->field[4]);
+		break;
+	case SCHED_WAKEUP:
+	case SCHED_WAKEUP_NEW:
+		event->target_cpu = read_event_field(data, size, &format->field[2]);
+		break;
+	case SCHED_MIGRATE_TASK:
+		event->cpu = read_event_field(data, size, &format->field[2]);
+		event->target_cpu = read_event_field(data, size, &format->field[3]);
+		break;
+	}
+}
+
+/*
+ * The kernel dropped events: the run-queues are rebuilt from procfs.
+ */
+void sched_events_lost(void)
+{
+	events_lost = 1;
+}
+
+static struct sched_events_cpu *get_cpu_queue(int cpu)
+{
+	if (cpu < 0 || cpu >= config_nr_cpus)
+		return NULL;
+
+	return cpu_queues[cpu];
+}
+
+static struct queued_task *find_task(struct sched_events_cpu *queue, long pid)
+{
+	int i;
+
+	for (i = 0; i < queue->nr_tasks; i++)
+		if (queue->tasks[i].pid == pid)
+			return &queue->tasks[i];
+
+	return NULL;
+}
+
+static void remove_task(struct sched_events_cpu *queue, struct queued_task *task)
+{
+	*task = queue->tasks[--queue->nr_tasks];
+}
+
+static struct queued_task *add_task(struct sched_events_cpu *queue, long pid, int prio)
+{
+	struct queued_task *task;
+
+	task = find_task(queue, pid);
+	if (!task) {
+		if (queue->nr_tasks == MAX_QUEUE_TASK) {
+			log_verbose("run-queue full, cannot track pid %ld\n", pid);
+			return NULL;
+		}
+
+		task = &queue->tasks[queue->nr_tasks++];
+		task->pid = pid;
+		task->tgid = 0;
+		task->ctxswc = ++progress_seq;
+	}
+
+	task->prio = prio;
+	task->is_rt = (prio >= 0 && prio <= 99);
+
+	return task;
+}
+
+/*
+ * prev_state is 0 (TASK_RUNNING) or has the preemption flag set, above
+ * the reported task states, if prev is still queued.
+ */
+static int prev_is_queued(long state)
+{
+	return state == 0 || state >= 0x100;
+}
+
+static void apply_sched_switch(struct sched_event *event)
+{
+	struct sched_events_cpu *queue = get_cpu_queue(event->cpu);
+	struct queued_task *task;
+
+	if (!queue)
+		return;
+
+	if (event->pid) {
+		if (prev_is_queued(event->state)) {
+			add_task(queue, event->pid, event->prio);
+		} else {
+			task = find_task(queue, event->pid);
+			if (task)
+				remove_task(queue, task);
+		}
+	}
+
+	queue->current = event->next_pid;
+
+	if (event->next_pid) {
+		task = add_task(queue, event->next_pid, event->next_prio);
+		if (task)
+			task->ctxswc = ++progress_seq;
+	}
+}
+
+static void apply_sched_wakeup(struct sched_event *event)
+{
+	struct sched_events_cpu *queue = get_cpu_queue(event->target_cpu);
+
+	if (queue)
+		add_task(queue, event->pid, event->prio);
+}
+
+static void apply_sched_migrate_task(struct sched_event *event)
+{
+	struct sched_events_cpu *orig = get_cpu_queue(event->cpu);
+	struct sched_events_cpu *dest = get_cpu_queue(event->target_cpu);
+	struct queued_task saved, *task;
+
+	/*
+	 * A task coming from a CPU that is not monitored is not known to
+	 * be queued, but a sleeping task is woken up right after, anyway.
+	 */
+	if (!orig) {
+		if (dest)
+			add_task(dest, event->pid, event->prio);
+		return;
+	}
+
+	task = find_task(orig, event->pid);
+	if (!task)
+		return;
+
+	saved = *task;
+	remove_task(orig, task);
+
+	if (!dest)
+		return;
+
+	task = add_task(dest, saved.pid, saved.prio);
+	if (task) {
+		task->tgid = saved.tgid;
+		task->ctxswc = saved.ctxswc;
+	}
+}
+
+/*
+ * Add the runnable tasks found in procfs to the run-queues.
+ */
+static void populate_queues(void)
+{
+	struct dirent *proc_entry, *task_entry;
+	char path[PROC_PID_FILE_PATH_LEN];
+	struct sched_events_cpu *queue;
+	struct proc_task_stat stat;
+	DIR *proc_dir, *task_dir;
+	struct queued_task *task;
+	char buffer[1024];
+	int tgid, tid;
+
+	proc_dir = opendir("/proc");
+	if (!proc_dir)
+		return;
+
+	while ((proc_entry = readdir(proc_dir))) {
+		if (!isdigit(proc_entry->d_name[0]))
+			continue;
+
+		tgid = atoi(proc_entry->d_name);
+
+		snprintf(path, sizeof(path), "/proc/%d/task", tgid);
+		task_dir = opendir(path);
+		if (!task_dir)
+			continue; /* It died. */
+
+		while ((task_entry = readdir(task_dir))) {
+			if (!isdigit(task_entry->d_name[0]))
+				continue;
+
+			tid = atoi(task_entry->d_name);
+
+			if (read_proc_task_file(tgid, tid, "stat", buffer, sizeof(buffer)) < 0)
+				continue;
+
+			if (parse_proc_task_stat(buffer, &stat) || stat.state != 'R')
+				continue;
+
+			queue = get_cpu_queue(stat.cpu);
+			if (!queue)
+				continue;
+
+			task = add_task(queue, tid, stat.prio);
+			if (task)
+				task->tgid = tgid;
+		}
+
+		closedir(task_dir);
+	}
+
+	closedir(proc_dir);
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct sched_event *ea = a, *eb = b;
+
+	if (ea->ts != eb->ts)
+		return ea->ts < eb->ts ? -1 : 1;
+
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/*
+ * Apply the events up to the watermark, the time at which the buffers
+ * started to be read. The later ones might not have been read from all
+ * the CPUs yet, so they wait for the next round.
+ */
+static void apply_events(uint64_t watermark)
+{
+	struct sched_event *event;
+	int applied;
+	int cpu;
+
+	qsort(pending, nr_pending, sizeof(*pending), compare_events);
+
+	pthread_mutex_lock(&events_lock);
+
+	for (applied = 0; applied < nr_pending; applied++) {
+		event = &pending[applied];
+		if (event->ts > watermark)
+			break;
+
+		switch (event->type) {
+		case SCHED_SWITCH:
+			apply_sched_switch(event);
+			break;
+		case SCHED_WAKEUP:
+		case SCHED_WAKEUP_NEW:
+			apply_sched_wakeup(event);
+			break;
+		case SCHED_MIGRATE_TASK:
+			apply_sched_migrate_task(event);
+			break;
+		}
+	}
+
+	if (events_lost) {
+		log_msg("sched events lost, rebuilding the run-queues\n");
+		for (cpu = 0; cpu < config_nr_cpus; cpu++)
+			if (cpu_queues[cpu])
+				cpu_queues[cpu]->nr_tasks = 0;
+		populate_queues();
+		events_lost = 0;
+	}
+
+	pthread_mutex_unlock(&events_lock);
+
+	nr_pending -= applied;
+	memmove(pending, pending + applied, nr_pending * sizeof(*pending));
+}
+
+/*
+ * Drain the kernel buffers and apply the events. The backends' fds become
+ * readable once their buffers are half full, so the event loop calls it
+ * before they overflow.
+ */
+int sched_events_process(void)
+{
+	uint64_t watermark;
+
+	pthread_mutex_lock(&drain_lock);
+
+	if (drain_events) {
+		watermark = get_time_ns();
+		drain_events();
+		apply_events(watermark);
+	}
+
+	pthread_mutex_unlock(&drain_lock);
+
+	return 0;
+}
+
+int sched_events_init(void)
+{
+	int i;
+
+	if (!find_tracefs_path(tracefs_path, sizeof(tracefs_path))) {
+		warn("cannot find the tracefs\n");
+		return -1;
+	}
+
+	for (i = 0; i < NR_SCHED_EVENTS; i++) {
+		if (read_event_format(&formats[i])) {
+			warn("cannot read the %s event format\n", formats[i].name);
+			return -1;
+		}
+	}
+
+	cpu_queues = allocate_memory(config_nr_cpus, sizeof(*cpu_queues));
+	/* The CPUs coming online later are tracked too. */
+	for_each_cpu(i, &config_monitored_cpus) {
+		cpu_queues[i] = allocate_memory(1, sizeof(struct sched_events_cpu));
+		cpu_queues[i]->current = -1;
+	}
+
+	/* it is static */
+	config_buffer_size = sizeof(struct sched_events_cpu);
+
+	return 0;
+}
+
+/*
+ * Register an fd that becomes readable when a kernel buffer needs
+ * to be drained.
+ */
+void sched_events_add_fd(int fd)
+{
+	event_fds = realloc(event_fds, (nr_event_fds + 1) * sizeof(*event_fds));
+	if (!event_fds)
+		die("cannot allocate memory");
+
+	event_fds[nr_event_fds++] = fd;
+
+	loop_add_backend_fd(fd);
+}
+
+void sched_events_remove_fd(int fd)
+{
+	int i;
+
+	loop_remove_backend_fd(fd);
+
+	for (i = 0; i < nr_event_fds; i++) {
+		if (event_fds[i] == fd) {
+			event_fds[i] = event_fds[--nr_event_fds];
+			break;
+		}
+	}
+}
+
+int sched_events_event_fds(int **fds)
+{
+	*fds = event_fds;
+	return nr_event_fds;
+}
+
+/*
+ * Start consuming the events, once the backend enabled them.
+ *
+ * The run-queues are populated from procfs after the events are enabled:
+ * the events that happened meanwhile are applied on top, so the last
+ * word on each task comes from them.
+ */
+int sched_events_start(void (*drain)(void))
+{
+	pthread_mutex_lock(&events_lock);
+	populate_queues();
+	pthread_mutex_unlock(&events_lock);
+
+	drain_events = drain;
+
+	return 0;
+}
+
+/*
+ * Bring the run-queues up to date before a scan.
+ */
+int sched_events_get(char *buffer, int size)
+{
+	sched_events_process();
+	return 1;
+}
+
+void sched_events_destroy(void)
+{
+	int i;
+
+	drain_events = NULL;
+
+	free(event_fds);
+	event_fds = NULL;
+	nr_event_fds = 0;
+
+	if (cpu_queues) {
+		for (i = 0; i < config_nr_cpus; i++)
+			free(cpu_queues[i]);
+		free(cpu_queues);
+		cpu_queues = NULL;
+	}
+
+	free(pending);
+	pending = NULL;
+	nr_pending = max_pending = 0;
+}
+
+int sched_events_get_cpu(char *buffer, int size, int cpu)
+{
+	struct sched_events_cpu *queue;
+	int queue_size;
+
+	if (size < sizeof(struct sched_events_cpu)) {
+		config_buffer_size = sizeof(struct sched_events_cpu);
+		log_msg("sched events are larger than the buffer, increasing the buffer to %zu\n",
+			config_buffer_size);
+		return 1;
+	}
+
+	pthread_mutex_lock(&events_lock);
+
+	queue = get_cpu_queue(cpu);
+	if (!queue) {
+		pthread_mutex_unlock(&events_lock);
+		return 0;
+	}
+
+	queue_size = offsetof(struct sched_events_cpu, tasks) + queue->nr_tasks * sizeof(struct queued_task);
+	memcpy(buffer, queue, queue_size);
+
+	pthread_mutex_unlock(&events_lock);
+
+	return queue_size;
+}
+
+int sched_events_parse(struct cpu_info *cpu_info, char *buffer, size_t buffer_size)
+{
+	struct sched_events_cpu *queue = (struct sched_events_cpu *) buffer;
+	struct task_info *old_tasks = cpu_info->starving;
+	int nr_old_tasks = cpu_info->nr_waiting_tasks;
+	long nr_running = 0, nr_rt_running = 0;
+	struct task_info *tasks, *task;
+	struct queued_task *qtask, *highest = NULL;
+	long current;
+	int tgid;
+	int i;
+
+	/*
+	 * Until the CPU switches, the running task is not known: the
+	 * scheduler runs the highest priority one.
+	 */
+	current = queue->current;
+	if (current < 0) {
+		for (i = 0; i < queue->nr_tasks; i++) {
+			qtask = &queue->tasks[i];
+			if (!highest || qtask->prio < highest->prio)
+				highest = qtask;
+		}
+		current = highest ? highest->pid : 0;
+	}
+
+	tasks = get_task_array(cpu_info, queue->nr_tasks);
+
+	for (i = 0; i < queue->nr_tasks; i++) {
+		qtask = &queue->tasks[i];
+
+		if (qtask->is_rt)
+			nr_rt_running++;
+
+		/*
+		 * Current task is not starving.
+		 */
+		if (qtask->pid == current)
+			continue;
+
+		tgid = qtask->tgid ? qtask->tgid : get_tgid(qtask->pid);
+		if (tgid < 0)
+			continue; /* It died. */
+
+		task = &tasks[nr_running];
+
+		if (fill_process_comm(tgid, qtask->pid, task->comm, COMM_SIZE))
+			continue;
+
+		task->pid = qtask->pid;
+		task->tgid = tgid;
+		task->prio = qtask->prio;
+		task->ctxsw = qtask->ctxswc;
+		task->runtime = 0;
+		task->since = get_time_ns();
+
+		nr_running++;
+	}
+
+	nr_running++; /* the current task */
+
+	cpu_info->starving = tasks;
+	cpu_info->nr_running = nr_running;
+	cpu_info->nr_rt_running = nr_rt_running;
+	cpu_info->nr_waiting_tasks = nr_running - 1;
+
+	if (old_tasks)
+		merge_taks_info(cpu_info->id, old_tasks, nr_old_tasks, cpu_info->starving, cpu_info->nr_waiting_tasks);
+
+	return 0;
+}
+
+int sched_events_has_starving_task(struct cpu_info *cpu)
+{
+	return !!cpu->nr_rt_running;
+}
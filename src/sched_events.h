@@ -0,0 +1,66 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __SCHED_EVENTS_H
+#define __SCHED_EVENTS_H
+
+#include "queue_track.h"
+
+/*
+ * The sched tracepoints used to rebuild the run-queues in user-space.
+ */
+enum sched_event_type {
+	SCHED_SWITCH = 0,
+	SCHED_WAKEUP,
+	SCHED_WAKEUP_NEW,
+	SCHED_MIGRATE_TASK,
+	NR_SCHED_EVENTS,
+};
+
+/*
+ * A field of a tracepoint record, as described by its tracefs format file.
+ */
+struct event_field {
+	int offset;
+	int size;
+};
+
+/*
+ * The run-queue of a monitored CPU, as rebuilt from the sched events,
+ * and as stored in the buffer by the ->get_cpu of the event backends.
+ */
+struct sched_events_cpu {
+	int current;	/* -1 until the first sched_switch */
+	int nr_tasks;
+	struct queued_task tasks[MAX_QUEUE_TASK];
+};
+
+extern char tracefs_path[MAX_DIR_PATH];
+
+int read_tracefs_file(const char *file, char *buffer, int size);
+int write_tracefs_file(const char *file, const char *value);
+int find_event_field(const char *format, const char *name, struct event_field *field);
+
+const char *sched_event_name(enum sched_event_type type);
+int sched_event_id(enum sched_event_type type);
+char *sched_event_cpu_filter(enum sched_event_type type);
+
+void sched_events_record(int cpu, uint64_t ts, void *data, int size);
+void sched_events_lost(void);
+void sched_events_add_fd(int fd);
+void sched_events_remove_fd(int fd);
+
+int sched_events_init(void);
+int sched_events_start(void (*drain)(void));
+void sched_events_destroy(void);
+int sched_events_event_fds(int **fds);
+int sched_events_process(void);
+int sched_events_get(char *buffer, int size);
+int sched_events_get_cpu(char *buffer, int size, int cpu);
+int sched_events_parse(struct cpu_info *cpu_info, char *buffer, size_t buffer_size);
+int sched_events_has_starving_task(struct cpu_info *cpu);
+
+extern struct stalld_backend ftrace_track_backend;
+extern struct stalld_backend perf_track_backend;
+
+#endif /* __SCHED_EVENTS_H */
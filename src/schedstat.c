@@ -0,0 +1,511 @@
+/*
+ * schedstat backend: finds starving tasks without debugfs and without BPF.
+ *
+ * /proc/schedstat tells which CPUs accumulated run-queue wait time
+ * (run_delay) since the last cycle. Only for those CPUs, the runnable
+ * tasks are collected from /proc/<pid>/task/<tid>/stat, and their
+ * progress from /proc/<pid>/task/<tid>/schedstat.
+ *
+ * The kernel accounts run_delay when a task gets the CPU, so a task that
+ * never runs does not make run_delay grow. Hence, CPUs that had wakeups
+ * or that already had waiting tasks in the last cycle are scanned too.
+ * The wakeups are counted on the CPU of the waker, though: a task woken
+ * from another CPU onto a CPU held by a real-time task moves neither
+ * counter of its CPU. So all the CPUs are scanned at least every half of
+ * the starving threshold.
+ *
+ * Walking all of /proc is the costly part: it is done for these periodic
+ * scans only, or when /proc/loadavg counts more runnable tasks than the
+ * known ones. Otherwise, only the tasks the last walk saw runnable on the
+ * selected CPUs are read again.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "schedstat.h"
+
+/*
+ * Minimum run_delay growth [ns] between two cycles for a CPU to be
+ * scanned.
+ */
+unsigned long config_run_delay_threshold = 1000000;
+
+/*
+ * Per-CPU threads share the CPU selection state.
+ */
+static pthread_mutex_t schedstat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cpu_schedstat *last_stats;
+static struct cpu_schedstat *curr_stats;
+static char *active_cpus;
+static char *cpu_had_waiting;
+static uint64_t last_walk;
+static int walk_due;
+static int first_sample;
+
+/*
+ * The tasks seen runnable on each CPU by the last walk of /proc, read
+ * again instead of walking /proc for each scan.
+ */
+struct known_tid {
+	int tgid;
+	int tid;
+};
+
+struct cpu_tids {
+	struct known_tid *tids;
+	int nr_tids;
+	int max_tids;
+};
+
+static struct cpu_tids *known_tids;
+
+static char *schedstat_buffer;
+static size_t schedstat_buffer_size;
+
+/*
+ * Select the CPUs whose run-queue needs a scan.
+ *
+ * Returns the number of selected CPUs, or -1 on error.
+ */
+static int select_active_cpus(void)
+{
+	struct cpu_schedstat *last, *curr, *tmp;
+	uint64_t now = get_time_ns();
+	int nr_active = 0;
+	int cpu;
+
+	if (!read_proc_schedstat(&schedstat_buffer, &schedstat_buffer_size))
+		return -1;
+
+	parse_proc_schedstat(schedstat_buffer, curr_stats, config_nr_cpus);
+
+	memset(active_cpus, 0, config_nr_cpus * sizeof(*active_cpus));
+
+	walk_due = first_sample || now - last_walk >= config_starving_threshold / 2;
+	if (walk_due)
+		last_walk = now;
+
+	for_each_cpu(cpu, &monitored_cpus) {
+		last = &last_stats[cpu];
+		curr = &curr_stats[cpu];
+
+		if (!curr->online)
+			continue;
+
+		if (walk_due || cpu_had_waiting[cpu]
+		    || curr->ttwu_count != last->ttwu_count
+		    || curr->run_delay - last->run_delay > config_run_delay_threshold) {
+			active_cpus[cpu] = 1;
+			nr_active++;
+		}
+	}
+
+	first_sample = 0;
+
+	tmp = last_stats;
+	last_stats = curr_stats;
+	curr_stats = tmp;
+
+	return nr_active;
+}
+
+/*
+ * Read the stat of a task, and tell if it is runnable on a known CPU.
+ */
+static int read_runnable_task(int tgid, int tid, struct proc_task_stat *stat)
+{
+	char buffer[1024];
+
+	if (read_proc_task_file(tgid, tid, "stat", buffer, sizeof(buffer)) < 0)
+		return 0;
+
+	if (parse_proc_task_stat(buffer, stat))
+		return 0;
+
+	return stat->state == 'R' && stat->cpu >= 0 && stat->cpu < config_nr_cpus;
+}
+
+/*
+ * Add a runnable task to the snapshot.
+ *
+ * Returns 1 if it did not fit, 0 otherwise.
+ */
+static int add_task(struct schedstat_snapshot *snapshot, int max_tasks, int tgid, int tid,
+		    struct proc_task_stat *stat)
+{
+	unsigned long long sum_exec_runtime, pcount;
+	struct schedstat_task *task;
+	char buffer[1024];
+
+	if (read_proc_task_file(tgid, tid, "schedstat", buffer, sizeof(buffer)) < 0)
+		return 0;
+
+	/* The run_delay in the middle is not needed. */
+	if (sscanf(buffer, "%llu %*s %llu", &sum_exec_runtime, &pcount) != 2)
+		return 0;
+
+	if (snapshot->nr_tasks >= max_tasks)
+		return 1;
+
+	task = &snapshot->tasks[snapshot->nr_tasks++];
+	memset(task, 0, sizeof(*task));
+	memcpy(task->comm, stat->comm, COMM_SIZE);
+	task->cpu = stat->cpu;
+	task->prio = stat->prio;
+	task->is_rt = (stat->policy == SCHED_FIFO || stat->policy == SCHED_RR);
+	task->pid = tid;
+	task->tgid = tgid;
+	task->sum_exec_runtime = sum_exec_runtime;
+	task->pcount = pcount;
+
+	return 0;
+}
+
+static void remember_task(int cpu, int tgid, int tid)
+{
+	struct cpu_tids *known = &known_tids[cpu];
+
+	if (known->nr_tids == known->max_tids) {
+		known->max_tids = known->max_tids ? known->max_tids * 2 : 16;
+		known->tids = realloc(known->tids, known->max_tids * sizeof(*known->tids));
+		if (!known->tids)
+			die("Cannot allocate memory");
+	}
+
+	known->tids[known->nr_tids].tgid = tgid;
+	known->tids[known->nr_tids].tid = tid;
+	known->nr_tids++;
+}
+
+/*
+ * Walk all the tasks in /proc: the runnable ones on the active CPUs go
+ * to the snapshot, and all the runnable ones are remembered on their CPU.
+ *
+ * Returns the number of tasks that did not fit.
+ */
+static int walk_tasks(struct schedstat_snapshot *snapshot, int max_tasks)
+{
+	struct dirent *proc_entry, *task_entry;
+	char path[PROC_PID_FILE_PATH_LEN];
+	struct proc_task_stat stat;
+	DIR *proc_dir, *task_dir;
+	int overflow = 0;
+	int tgid, tid;
+	int cpu;
+
+	proc_dir = opendir("/proc");
+	if (!proc_dir)
+		return 0;
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++)
+		known_tids[cpu].nr_tids = 0;
+
+	while ((proc_entry = readdir(proc_dir))) {
+		if (!isdigit(proc_entry->d_name[0]))
+			continue;
+
+		tgid = atoi(proc_entry->d_name);
+
+		snprintf(path, sizeof(path), "/proc/%d/task", tgid);
+		task_dir = opendir(path);
+		if (!task_dir)
+			continue; /* It died. */
+
+		while ((task_entry = readdir(task_dir))) {
+			if (!isdigit(task_entry->d_name[0]))
+				continue;
+
+			tid = atoi(task_entry->d_name);
+
+			if (!read_runnable_task(tgid, tid, &stat))
+				continue;
+
+			remember_task(stat.cpu, tgid, tid);
+
+			if (active_cpus[stat.cpu])
+				overflow += add_task(snapshot, max_tasks, tgid, tid, &stat);
+		}
+
+		closedir(task_dir);
+	}
+
+	closedir(proc_dir);
+
+	return overflow;
+}
+
+/*
+ * Read again only the tasks that were runnable on the active CPUs. The
+ * ones that are not runnable there anymore are forgotten.
+ *
+ * Returns the number of tasks that did not fit.
+ */
+static int rescan_known_tasks(struct schedstat_snapshot *snapshot, int max_tasks)
+{
+	struct proc_task_stat stat;
+	struct cpu_tids *known;
+	int overflow = 0;
+	int cpu, i, kept;
+
+	for_each_cpu(cpu, &monitored_cpus) {
+		if (!active_cpus[cpu])
+			continue;
+
+		known = &known_tids[cpu];
+		kept = 0;
+		for (i = 0; i < known->nr_tids; i++) {
+			if (!read_runnable_task(known->tids[i].tgid, known->tids[i].tid, &stat))
+				continue;
+
+			if (stat.cpu != cpu)
+				continue;
+
+			known->tids[kept++] = known->tids[i];
+			overflow += add_task(snapshot, max_tasks, known->tids[i].tgid,
+					     known->tids[i].tid, &stat);
+		}
+		known->nr_tids = kept;
+	}
+
+	return overflow;
+}
+
+/*
+ * Tell if there are more runnable tasks than the known ones: one of them
+ * is unknown, and only a walk finds it. The known tasks of the CPUs not
+ * rescanned may have stopped running and hide it, the periodic walk
+ * bounds that.
+ */
+static int has_unknown_tasks(void)
+{
+	unsigned long nr_running = 0;
+	unsigned long nr_known = 0;
+	char buffer[128];
+	int retval;
+	int cpu;
+	int fd;
+
+	fd = open("/proc/loadavg", O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	retval = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (retval <= 0)
+		return 1;
+
+	buffer[retval] = '\0';
+
+	/* The fourth field is running/total. */
+	if (sscanf(buffer, "%*s %*s %*s %lu/", &nr_running) != 1)
+		return 1;
+
+	for (cpu = 0; cpu < config_nr_cpus; cpu++)
+		nr_known += known_tids[cpu].nr_tids;
+
+	return nr_running > nr_known;
+}
+
+/*
+ * Collect the runnable tasks on the active CPUs into the snapshot. The
+ * tasks known to be runnable on them are read again, /proc is walked
+ * only if there are unknown ones, or every half of the starving
+ * threshold.
+ *
+ * Returns the number of tasks that did not fit.
+ */
+static int collect_tasks(struct schedstat_snapshot *snapshot, int max_tasks)
+{
+	int overflow;
+
+	if (!walk_due) {
+		overflow = rescan_known_tasks(snapshot, max_tasks);
+		if (!has_unknown_tasks())
+			return overflow;
+
+		snapshot->nr_tasks = 0;
+	}
+
+	return walk_tasks(snapshot, max_tasks);
+}
+
+static int schedstat_get(char *buffer, int size)
+{
+	struct schedstat_snapshot *snapshot = (struct schedstat_snapshot *) buffer;
+	int max_tasks;
+	int nr_active;
+	int overflow;
+
+	max_tasks = (size - sizeof(*snapshot)) / sizeof(struct schedstat_task);
+
+	pthread_mutex_lock(&schedstat_lock);
+
+	snapshot->nr_tasks = 0;
+
+	nr_active = select_active_cpus();
+	if (nr_active < 0) {
+		pthread_mutex_unlock(&schedstat_lock);
+		return 0;
+	}
+
+	if (nr_active) {
+		overflow = collect_tasks(snapshot, max_tasks);
+		if (overflow) {
+			config_buffer_size = config_buffer_size * 2;
+			log_msg("schedstat is getting larger, increasing the buffer to %zu\n",
+				config_buffer_size);
+		}
+	}
+
+	pthread_mutex_unlock(&schedstat_lock);
+
+	return sizeof(*snapshot) + snapshot->nr_tasks * sizeof(struct schedstat_task);
+}
+
+/*
+ * The running task is not listed as such in procfs. The scheduler runs the
+ * highest priority runnable task, so that is the one considered current.
+ * Among equals, the one that ran the most.
+ */
+static struct schedstat_task *find_current(struct schedstat_snapshot *snapshot, int cpu)
+{
+	struct schedstat_task *current = NULL;
+	struct schedstat_task *task;
+	int i;
+
+	for (i = 0; i < snapshot->nr_tasks; i++) {
+		task = &snapshot->tasks[i];
+		if (task->cpu != cpu)
+			continue;
+
+		if (!current || task->prio < current->prio
+		    || (task->prio == current->prio
+			&& task->sum_exec_runtime > current->sum_exec_runtime))
+			current = task;
+	}
+
+	return current;
+}
+
+static int schedstat_parse(struct cpu_info *cpu_info, char *buffer, size_t buffer_size)
+{
+	struct schedstat_snapshot *snapshot = (struct schedstat_snapshot *) buffer;
+	struct task_info *old_tasks = cpu_info->starving;
+	int nr_old_tasks = cpu_info->nr_waiting_tasks;
+	struct schedstat_task *current, *stask;
+	long nr_running = 0, nr_rt_running = 0;
+	struct task_info *tasks, *task;
+	int nr_waiting = 0;
+	int i;
+
+	current = find_current(snapshot, cpu_info->id);
+
+	for (i = 0; i < snapshot->nr_tasks; i++)
+		if (snapshot->tasks[i].cpu == cpu_info->id)
+			nr_running++;
+
+	tasks = get_task_array(cpu_info, nr_running);
+
+	for (i = 0; i < snapshot->nr_tasks; i++) {
+		stask = &snapshot->tasks[i];
+		if (stask->cpu != cpu_info->id)
+			continue;
+
+		if (stask->is_rt)
+			nr_rt_running++;
+
+		if (stask == current)
+			continue;
+
+		task = &tasks[nr_waiting++];
+		memcpy(task->comm, stask->comm, COMM_SIZE);
+		task->pid = stask->pid;
+		task->tgid = stask->tgid;
+		task->prio = stask->prio;
+		task->ctxsw = stask->pcount;
+		task->runtime = stask->sum_exec_runtime;
+		task->since = get_time_ns();
+	}
+
+	cpu_info->starving = tasks;
+	cpu_info->nr_running = nr_running;
+	cpu_info->nr_rt_running = nr_rt_running;
+	cpu_info->nr_waiting_tasks = nr_waiting;
+
+	cpu_had_waiting[cpu_info->id] = !!nr_waiting;
+
+	if (old_tasks)
+		merge_taks_info(cpu_info->id, old_tasks, nr_old_tasks, cpu_info->starving, cpu_info->nr_waiting_tasks);
+
+	return 0;
+}
+
+static int schedstat_has_starving_task(struct cpu_info *cpu)
+{
+	return !!cpu->nr_rt_running;
+}
+
+static int schedstat_init(void)
+{
+	if (!read_proc_schedstat(&schedstat_buffer, &schedstat_buffer_size)) {
+		warn("cannot read /proc/schedstat: is CONFIG_SCHEDSTATS enabled?\n");
+		return -1;
+	}
+
+	if (strncmp(schedstat_buffer, "version ", 8) || atoi(schedstat_buffer + 8) < 15) {
+		warn("unsupported /proc/schedstat version\n");
+		return -1;
+	}
+
+	last_stats = allocate_memory(config_nr_cpus, sizeof(*last_stats));
+	curr_stats = allocate_memory(config_nr_cpus, sizeof(*curr_stats));
+	active_cpus = allocate_memory(config_nr_cpus, sizeof(*active_cpus));
+	cpu_had_waiting = allocate_memory(config_nr_cpus, sizeof(*cpu_had_waiting));
+	known_tids = allocate_memory(config_nr_cpus, sizeof(*known_tids));
+	first_sample = 1;
+
+	config_buffer_size = BUFFER_PAGES * page_size;
+	log_msg("using /proc/schedstat, run_delay threshold %lu ns\n", config_run_delay_threshold);
+
+	return 0;
+}
+
+static void schedstat_destroy(void)
+{
+	int cpu;
+
+	free(last_stats);
+	free(curr_stats);
+	free(active_cpus);
+	free(cpu_had_waiting);
+	for (cpu = 0; cpu < config_nr_cpus; cpu++)
+		free(known_tids[cpu].tids);
+	free(known_tids);
+	free(schedstat_buffer);
+	schedstat_buffer = NULL;
+	schedstat_buffer_size = 0;
+}
+
+struct stalld_backend schedstat_backend = {
+	.init			= schedstat_init,
+	.get			= schedstat_get,
+	.parse			= schedstat_parse,
+	.has_starving_task	= schedstat_has_starving_task,
+	.destroy		= schedstat_destroy,
+};
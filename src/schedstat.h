@@ -0,0 +1,33 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __SCHEDSTAT_H
+#define __SCHEDSTAT_H
+
+/*
+ * A runnable task found on a CPU that crossed the run_delay threshold,
+ * as stored in the buffer by the schedstat backend's ->get.
+ */
+struct schedstat_task {
+	int cpu;
+	int pid;
+	int tgid;
+	int prio;
+	int is_rt;
+	/*
+	 * Both move whenever the task gets the CPU: merge_taks_info() carries
+	 * 'since' forward only while neither does.
+	 */
+	uint64_t pcount;
+	uint64_t sum_exec_runtime;
+	char comm[COMM_SIZE];
+};
+
+struct schedstat_snapshot {
+	int nr_tasks;
+	struct schedstat_task tasks[];
+};
+
+extern struct stalld_backend schedstat_backend;
+
+#endif /* __SCHEDSTAT_H */
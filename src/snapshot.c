@@ -0,0 +1,159 @@
+/*
+ * The per-cycle snapshot of the scheduler state.
+ *
+ * The thread driving the scan reads the backend and /proc/stat once per
+ * cycle into a snapshot, and publishes it. The CPU monitors take a
+ * reference to the current snapshot and parse their CPU out of it, so the
+ * I/O does not grow with the number of monitored CPUs. A new snapshot
+ * replaces the current one without waiting for its readers: the last
+ * reference to go frees it, or keeps it as the spare for the next cycle,
+ * saving the allocation of the buffers.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "snapshot.h"
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stalld_snapshot *current;
+static struct stalld_snapshot *spare;
+static unsigned long snapshot_version;
+
+static void free_snapshot(struct stalld_snapshot *snapshot)
+{
+	free(snapshot->buffer);
+	free(snapshot->proc_stat);
+	free(snapshot);
+}
+
+/*
+ * Start the snapshot of a new cycle, reading /proc/stat if the idle
+ * detection is enabled. The caller holds the only reference to it.
+ */
+struct stalld_snapshot *snapshot_new(void)
+{
+	struct stalld_snapshot *snapshot;
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot = spare;
+	spare = NULL;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (!snapshot) {
+		snapshot = allocate_memory(1, sizeof(*snapshot));
+		snapshot->proc_stat = allocate_memory(1, STAT_MAX_SIZE);
+	}
+
+	snapshot->refcount = 1;
+	snapshot->size = 0;
+	snapshot->proc_stat_size = 0;
+
+	if (config_idle_detection) {
+		snapshot->proc_stat_size = read_proc_stat(snapshot->proc_stat, STAT_MAX_SIZE);
+		if (!snapshot->proc_stat_size) {
+			warn("fail reading sched stat file");
+			warn("disabling idle detection");
+			config_idle_detection = 0;
+		}
+	}
+
+	return snapshot;
+}
+
+/*
+ * Read the backend into the snapshot. Returns 0 on failure.
+ */
+int snapshot_read_backend(struct stalld_snapshot *snapshot)
+{
+	if (!backend->get)
+		return 1;
+
+	/* Buffer size should increase. See sched_debug_get(). */
+	if (!snapshot->buffer) {
+		snapshot->buffer = allocate_memory(1, config_buffer_size);
+		snapshot->buffer_size = config_buffer_size;
+	} else {
+		resize_buffer_if_needed(&snapshot->buffer, &snapshot->buffer_size);
+	}
+
+	snapshot->size = backend->get(snapshot->buffer, snapshot->buffer_size);
+	if (!snapshot->size) {
+		warn("fail reading backend");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Make the snapshot the current one. The caller keeps its reference.
+ */
+void snapshot_publish(struct stalld_snapshot *snapshot)
+{
+	struct stalld_snapshot *old;
+
+	__atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot->version = ++snapshot_version;
+	old = current;
+	current = snapshot;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (old)
+		snapshot_put(old);
+}
+
+/*
+ * A reference to the current snapshot, NULL if there is none yet.
+ */
+struct stalld_snapshot *snapshot_get(void)
+{
+	struct stalld_snapshot *snapshot;
+
+	pthread_mutex_lock(&snapshot_lock);
+	snapshot = current;
+	if (snapshot)
+		__atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&snapshot_lock);
+
+	return snapshot;
+}
+
+void snapshot_put(struct stalld_snapshot *snapshot)
+{
+	if (__atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	pthread_mutex_lock(&snapshot_lock);
+	if (!spare) {
+		spare = snapshot;
+		snapshot = NULL;
+	}
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if (snapshot)
+		free_snapshot(snapshot);
+}
+
+/*
+ * Free the snapshots, once all the readers are gone.
+ */
+void snapshot_destroy(void)
+{
+	pthread_mutex_lock(&snapshot_lock);
+	if (current && !__atomic_sub_fetch(&current->refcount, 1, __ATOMIC_ACQ_REL))
+		free_snapshot(current);
+	if (spare)
+		free_snapshot(spare);
+	current = NULL;
+	spare = NULL;
+	pthread_mutex_unlock(&snapshot_lock);
+}
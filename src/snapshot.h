@@ -0,0 +1,27 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+/*
+ * The data of a scan cycle, read once and parsed by all the CPU monitors.
+ */
+struct stalld_snapshot {
+	unsigned long version;
+	int refcount;
+	char *buffer;		/* the backend data, if backend->get exists */
+	size_t buffer_size;
+	int size;		/* 0 if the backend was not read */
+	char *proc_stat;	/* /proc/stat, for the idle detection */
+	int proc_stat_size;	/* 0 if it was not read */
+};
+
+struct stalld_snapshot *snapshot_new(void);
+int snapshot_read_backend(struct stalld_snapshot *snapshot);
+void snapshot_publish(struct stalld_snapshot *snapshot);
+struct stalld_snapshot *snapshot_get(void);
+void snapshot_put(struct stalld_snapshot *snapshot);
+void snapshot_destroy(void);
+
+#endif /* __SNAPSHOT_H */
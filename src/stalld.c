@@ -36,7 +36,13 @@
 
 #include "stalld.h"
 #include "sched_debug.h"
+#include "schedstat.h"
 #include "queue_track.h"
+#include "event_loop.h"
+#include "boost.h"
+#include "workers.h"
+#include "snapshot.h"
+#include "fair_server.h"
 
 /*
  * version
@@ -70,18 +76,54 @@ unsigned long config_fifo_priority = 98;
 unsigned long config_force_fifo = 0;
 
 /*
- * Control loop (time in seconds).
+ * Maximum number of concurrent boosts, 0 for no limit.
  */
-long config_starving_threshold = 20;
-long config_boost_duration = 3;
+int config_max_boosts = 0;
+
+/*
+ * Size the boosts per class of tasks, from the progress of the tasks.
+ */
+int config_adaptive_boost = 0;
+
+/*
+ * Boost the starving fair tasks with the DL-server of their CPU.
+ */
+int config_fair_server = 0;
+
+/*
+ * Restore the boosted tasks as soon as they go to sleep.
+ */
+int config_early_deboost = 0;
+
+/*
+ * Boost the starving tasks of a CPU at once, sharing this runtime per
+ * period, 0 to boost them one by one.
+ */
+uint64_t config_batch_boost = 0;
+
+/*
+ * The noise the boosts can inject on a CPU per window, 0 for no limit.
+ */
+uint64_t config_noise_budget = 0;
+uint64_t config_noise_window = 60 * NS_PER_SEC;
+
+/*
+ * Control loop (time in nanoseconds).
+ */
+uint64_t config_starving_threshold = 20 * NS_PER_SEC;
+uint64_t config_boost_duration = 3 * NS_PER_SEC;
 long config_aggressive = 0;
-long config_granularity = 5;
+uint64_t config_granularity = 5 * NS_PER_SEC;
 
 /*
- * XXX: Make it a cpu mask, lazy Daniel!
+ * The CPUs to monitor, all by default or as set with -c, and the ones
+ * actually monitored: those of them that are online. The per-CPU state is
+ * sized for the possible CPUs, config_nr_cpus.
  */
 int config_monitor_all_cpus = 1;
-char *config_monitored_cpus;
+struct cpumask config_monitored_cpus;
+struct cpumask monitored_cpus;
+struct cpumask online_cpus;
 int config_nr_cpus;
 
 /*
@@ -129,6 +171,11 @@ int config_adaptive_multi_threaded = 0;
 int config_idle_detection = 1;
 int STAT_MAX_SIZE = 4096;
 
+/*
+ * Check the run_delay in /proc/schedstat before parsing sched_debug.
+ */
+int config_run_delay_filter = 0;
+
 /*
  * Variables related to the threads to be ignored.
  */
@@ -168,6 +215,11 @@ struct stalld_backend *backend = &sched_debug_backend;
  */
 char *config_affinity_cpus;
 
+/*
+ * Run on the housekeeping CPUs and monitor the isolated ones.
+ */
+int config_housekeeping = 0;
+
 /*
  * calculate a buffer size to use when reading /proc/stat
  */
@@ -223,19 +275,14 @@ static long get_cpu_idle_time(char *buffer, size_t buffer_size, int cpu)
 	return idle;
 }
 
-int cpu_had_idle_time(struct cpu_info *cpu_info)
+int cpu_had_idle_time(struct cpu_info *cpu_info, struct stalld_snapshot *snapshot)
 {
-	char proc_stat[STAT_MAX_SIZE];
 	long idle_time;
 
-	if (!read_proc_stat(proc_stat, STAT_MAX_SIZE)) {
-		warn("fail reading sched stat file");
-		warn("disabling idle detection");
-		config_idle_detection = 0;
+	if (!snapshot->proc_stat_size)
 		return 0;
-	}
 
-	idle_time = get_cpu_idle_time(proc_stat, STAT_MAX_SIZE, cpu_info->id);
+	idle_time = get_cpu_idle_time(snapshot->proc_stat, snapshot->proc_stat_size, cpu_info->id);
 	if (idle_time < 0) {
 		if (idle_time != -ENODEV)
 			warn("unable to parse idle time for cpu%d\n", cpu_info->id);
@@ -259,24 +306,19 @@ int cpu_had_idle_time(struct cpu_info *cpu_info)
 	return 1;
 }
 
-int get_cpu_busy_list(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list)
+int get_cpu_busy_list(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list,
+		      struct stalld_snapshot *snapshot)
 {
-	char proc_stat[STAT_MAX_SIZE];
 	struct cpu_info *cpu;
 	int busy_count = 0;
 	long idle_time;
 	int i;
 
-	if (!read_proc_stat(proc_stat, STAT_MAX_SIZE)) {
-		warn("fail reading sched stat file");
-		warn("disabling idle detection");
-		config_idle_detection = 0;
-
-		/* Assume they are all busy. */
+	/* Assume they are all busy. */
+	if (!snapshot->proc_stat_size)
 		return nr_cpus;
-	}
 
-	for (i = 0; i < nr_cpus; i++) {
+	for_each_cpu(i, &monitored_cpus) {
 		cpu = &cpus[i];
 		/* Consider idle a CPU that has its own monitor. */
 		if (cpu->thread_running) {
@@ -284,7 +326,7 @@ int get_cpu_busy_list(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list)
 			continue;
 		}
 
-		idle_time = get_cpu_idle_time(proc_stat, STAT_MAX_SIZE, cpu->id);
+		idle_time = get_cpu_idle_time(snapshot->proc_stat, snapshot->proc_stat_size, cpu->id);
 		if (idle_time < 0) {
 			if (idle_time != -ENODEV)
 				warn("unable to parse idle time for cpu%d\n", cpu->id);
@@ -317,16 +359,85 @@ int get_cpu_busy_list(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list)
 	return busy_count;
 }
 
+/*
+ * Drop from cpu_list the CPUs whose run-queue did not delay any task.
+ *
+ * A CPU is kept if its run_delay grew by more than config_run_delay_threshold,
+ * if it had wakeups, if it had waiting tasks at the last parse, or if it was
+ * not parsed for half of the starving threshold. The last one is needed
+ * because a task that never runs does not account run_delay, so a new
+ * starving task is only seen by the periodic parse.
+ *
+ * Returns the number of CPUs left in cpu_list.
+ */
+int get_cpu_delayed_list(struct cpu_info *cpus, int nr_cpus, char *cpu_list)
+{
+	static struct cpu_schedstat *stats;
+	static size_t schedstat_size;
+	static char *schedstat;
+	struct cpu_schedstat *curr;
+	struct cpu_info *cpu;
+	int delayed_count = 0;
+	uint64_t now;
+	int i;
+
+	if (!read_proc_schedstat(&schedstat, &schedstat_size)) {
+		warn("fail reading /proc/schedstat");
+		warn("disabling the run_delay filter");
+		config_run_delay_filter = 0;
+
+		for_each_cpu(i, &monitored_cpus)
+			delayed_count += cpu_list[i];
+		return delayed_count;
+	}
+
+	/* Kept across the calls, like the file buffer. */
+	if (!stats)
+		stats = allocate_memory(nr_cpus, sizeof(*stats));
+
+	parse_proc_schedstat(schedstat, stats, nr_cpus);
+	now = get_time_ns();
+
+	for_each_cpu(i, &monitored_cpus) {
+		if (!cpu_list[i])
+			continue;
+
+		cpu = &cpus[i];
+		curr = &stats[i];
+
+		if (!curr->online) {
+			delayed_count++;
+			continue;
+		}
+
+		if (cpu->nr_waiting_tasks
+		    || curr->ttwu_count != cpu->ttwu_count
+		    || curr->run_delay - cpu->run_delay > config_run_delay_threshold
+		    || now - cpu->last_parse >= config_starving_threshold / 2) {
+			cpu->last_parse = now;
+			delayed_count++;
+		} else {
+			log_verbose("\t cpu %d had no run-queue delay\n", cpu->id);
+			cpu_list[i] = 0;
+		}
+
+		cpu->run_delay = curr->run_delay;
+		cpu->ttwu_count = curr->ttwu_count;
+	}
+
+	return delayed_count;
+}
+
 void print_waiting_tasks(struct cpu_info *cpu_info)
 {
-	time_t now;
+	uint64_t now;
 	struct task_info *task;
 	int i;
 
 	if (!config_verbose)
 		return;
 
-	now = time(NULL);
+	now = get_time_ns();
 	printf("CPU %d has %d waiting tasks\n", cpu_info->id, cpu_info->nr_waiting_tasks);
 	if (!cpu_info->nr_waiting_tasks)
 		return;
@@ -334,75 +445,210 @@ void print_waiting_tasks(struct cpu_info *cpu_info)
 	for (i = 0; i < cpu_info->nr_waiting_tasks; i++) {
 		task = &cpu_info->starving[i];
 
-		printf("%15s %9d %9d %9d %9ld\n",task->comm, task->pid,
-		       task->prio, task->ctxsw, (now - task->since));
+		printf("%15s %9d %9d %9d %9.3f\n",task->comm, task->pid,
+		       task->prio, task->ctxsw, ns_to_sec(now - task->since));
 	}
 
 	return;
 }
 
+/*
+ * The starving tasks of a CPU in the single-threaded mode, oldest first.
+ * Up to MAX_STARVING_TASKS are boosted in a cycle; when more tasks
+ * starved, the CPU is overloaded and rescanned right away.
+ */
+#define MAX_STARVING_TASKS	8
+
 struct cpu_starving_task_info {
-	struct task_info task;
-	int pid;
-	int tgid;
-	time_t since;
+	int nr_tasks;
+	struct task_info tasks[MAX_STARVING_TASKS];
 	int overloaded;
 };
 
 struct cpu_starving_task_info *cpu_starving_vector;
 
+/*
+ * The active boosts, restored by the loop of the main thread, whatever
+ * the thread that boosted them.
+ */
+static pthread_mutex_t boosts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stalld_loop *boosts_loop;
+static struct boost_heap boosts;
+
+/*
+ * The starving tasks waiting for a boost, in a min-heap by since, so the
+ * ones that starved the longest are boosted first. Protected by
+ * boosts_lock, like the admission state: the boosts being set up, and
+ * the back-off after the SCHED_DEADLINE admission control refused one.
+ */
+static struct boost_heap starving_tasks;
+static int nr_boosting;
+static uint64_t boost_backoff;
+static uint64_t boost_backoff_end;
+
+/*
+ * The runtime per CPU of the batches being set up, not tracked yet.
+ * Protected by boosts_lock.
+ */
+static uint64_t *batch_runtime;
+
+static int is_boosted(int pid);
+
+static void reset_cpu_starving_vector(int cpu)
+{
+	cpu_starving_vector[cpu].nr_tasks = 0;
+	cpu_starving_vector[cpu].overloaded = 0;
+}
+
 void update_cpu_starving_vector(int cpu, const struct task_info *task)
 {
 	struct cpu_starving_task_info *cpu_info = &cpu_starving_vector[cpu];
+	const struct task_info *newest;
+	int i;
 
-	/*
-	 * If there is another thread already here, mark this CPU as
-	 * overloaded.
-	 */
-	if (cpu_info->pid)
-		cpu_info->overloaded = 1;
+	/* A boosted task is not starving anymore, let the others in. */
+	if (is_boosted(task->pid))
+		return;
 
 	/*
-	 * If there is no thread in the vector, or if the in the
-	 * vector has an earlier since (timestamp), update it.
-	 * Also, check if the PIDs match if detect task migration.
+	 * With no room left, the newest task is dropped. If it starved
+	 * already, the CPU is overloaded: it needs another scan.
 	 */
-	if (cpu_info->since == 0
-	    || cpu_info->since > task->since
-	    || cpu_info->pid != task->pid) {
-		memcpy(&(cpu_info->task), task, sizeof(struct task_info));
-		cpu_info->pid = task->pid;
-		cpu_info->tgid = task->tgid;
-		cpu_info->since = task->since;
+	if (cpu_info->nr_tasks == MAX_STARVING_TASKS) {
+		newest = &cpu_info->tasks[MAX_STARVING_TASKS - 1];
+		if (newest->since <= task->since)
+			newest = task;
+
+		if (get_time_ns() - newest->since >= config_starving_threshold)
+			cpu_info->overloaded = 1;
+
+		if (newest == task)
+			return;
+
+		cpu_info->nr_tasks--;
+	}
+
+	/* Keep the tasks sorted by since, the oldest first. */
+	for (i = cpu_info->nr_tasks; i > 0; i--) {
+		if (cpu_info->tasks[i - 1].since <= task->since)
+			break;
+		cpu_info->tasks[i] = cpu_info->tasks[i - 1];
 	}
+
+	cpu_info->tasks[i] = *task;
+	cpu_info->nr_tasks++;
 }
 
-void merge_taks_info(int cpu, struct task_info *old_tasks, int nr_old, struct task_info *new_tasks, int nr_new)
+/*
+ * The array to fill with the tasks of a new parse of the CPU. Each CPU
+ * has two arrays, swapping roles at each parse: the other one holds the
+ * tasks of the last parse, that merge_taks_info() reads. They only grow,
+ * so the steady state does not allocate.
+ */
+struct task_info *get_task_array(struct cpu_info *cpu, int nr_tasks)
+{
+	int next = cpu->starving == cpu->task_arrays[0] ? 1 : 0;
+	int max_tasks = cpu->max_tasks[next] ? cpu->max_tasks[next] : 16;
+
+	if (nr_tasks <= cpu->max_tasks[next])
+		return cpu->task_arrays[next];
+
+	while (max_tasks < nr_tasks)
+		max_tasks *= 2;
+
+	cpu->task_arrays[next] = realloc(cpu->task_arrays[next], max_tasks * sizeof(struct task_info));
+	if (!cpu->task_arrays[next])
+		die("cannot allocate memory");
+
+	cpu->max_tasks[next] = max_tasks;
+
+	return cpu->task_arrays[next];
+}
+
+/*
+ * The pid hash of merge_taks_info(), with open addressing. A slot holds
+ * the position of the task in the new tasks plus one, 0 if it is empty.
+ * It is reused across the cycles, one per thread, as the worker threads
+ * merge their CPUs concurrently.
+ */
+static __thread int *merge_hash;
+static __thread unsigned int merge_hash_size;
+
+static inline unsigned int pid_hash(int pid, unsigned int mask)
 {
-	static const struct task_info notask = {};
+	return ((unsigned int) pid * 2654435761u) & mask;
+}
 
+/*
+ * Prepare a hash with at least twice as many slots as tasks, so the
+ * probe sequences stay short. Only the slots used by this merge are
+ * cleared: the table is as large as the longest run-queue seen, and the
+ * short ones must not pay for it.
+ */
+static unsigned int reset_merge_hash(int nr_tasks)
+{
+	unsigned int size = 16;
+
+	while (size < 2 * (unsigned int) nr_tasks)
+		size *= 2;
+
+	if (size > merge_hash_size) {
+		free(merge_hash);
+		merge_hash = allocate_memory(size, sizeof(*merge_hash));
+		merge_hash_size = size;
+	} else {
+		memset(merge_hash, 0, size * sizeof(*merge_hash));
+	}
+
+	return size - 1;
+}
+
+/*
+ * Carry the since of the tasks that did not run since the last parse
+ * forward: the new tasks are hashed by pid, so the merge is linear in
+ * the number of tasks.
+ */
+void merge_taks_info(int cpu, struct task_info *old_tasks, int nr_old, struct task_info *new_tasks, int nr_new)
+{
 	struct task_info *old_task;
 	struct task_info *new_task;
+	unsigned int mask;
+	unsigned int slot;
 	int i;
-	int j;
 
 	if (config_single_threaded)
-		update_cpu_starving_vector(cpu, &notask);
+		reset_cpu_starving_vector(cpu);
+
+	if (!nr_old || !nr_new)
+		return;
+
+	mask = reset_merge_hash(nr_new);
+
+	for (i = 0; i < nr_new; i++) {
+		slot = pid_hash(new_tasks[i].pid, mask);
+		while (merge_hash[slot] && new_tasks[merge_hash[slot] - 1].pid != new_tasks[i].pid)
+			slot = (slot + 1) & mask;
+
+		/* Like a scan of the new tasks, the first one wins. */
+		if (!merge_hash[slot])
+			merge_hash[slot] = i + 1;
+	}
 
 	for (i = 0; i < nr_old; i++) {
 		old_task = &old_tasks[i];
 
-		for (j = 0; j < nr_new; j++) {
-			new_task = &new_tasks[j];
+		slot = pid_hash(old_task->pid, mask);
+		while (merge_hash[slot] && new_tasks[merge_hash[slot] - 1].pid != old_task->pid)
+			slot = (slot + 1) & mask;
 
-			if (old_task->pid == new_task->pid) {
-				if (old_task->ctxsw == new_task->ctxsw) {
-					new_task->since = old_task->since;
-					if (config_single_threaded)
-						update_cpu_starving_vector(cpu, new_task);
-				}
-				break;
-			}
+		if (!merge_hash[slot])
+			continue;
+
+		new_task = &new_tasks[merge_hash[slot] - 1];
+		if (old_task->ctxsw == new_task->ctxsw && old_task->runtime == new_task->runtime) {
+			new_task->since = old_task->since;
+			if (config_single_threaded)
+				update_cpu_starving_vector(cpu, new_task);
 		}
 	}
 }
@@ -411,16 +657,18 @@ void merge_taks_info(int cpu, struct task_info *old_tasks, int nr_old, struct ta
  * cleanup_starving_task_info - Reset a CPU's starving task info structure
  * @info: Pointer to the cpu_starving_task_info structure to clean up
  *
- * Clears all fields in the starving task info structure, effectively removing
- * any tracked starving task for this CPU. This function preserves the overloaded
- * flag value before clearing the structure and returns it to the caller.
+ * Clears the starving tasks tracked for this CPU. This function preserves
+ * the overloaded flag value before clearing the structure and returns it
+ * to the caller.
  *
  * Return: The previous value of the overloaded flag before cleanup
  */
 static int cleanup_starving_task_info(struct cpu_starving_task_info *info)
 {
 	const int overloaded = info->overloaded;
-	bzero(info, sizeof *info);
+
+	info->nr_tasks = 0;
+	info->overloaded = 0;
 	return overloaded;
 }
 
@@ -434,154 +682,862 @@ int get_current_policy(int pid, struct sched_attr *attr)
 	return ret;
 }
 
-void print_boosted_info(int tgid, int pid, struct cpu_info *cpu, char *type)
+void print_boosted_info(const char *comm, int pid, struct cpu_info *cpu, char *type)
 {
-	char comm[COMM_SIZE];
-
 	/* Validate inputs to prevent crashes */
 	if (!type) {
 		warn("print_boosted_info called with NULL type\n");
 		return;
 	}
 
-	if (fill_process_comm(tgid, pid, comm, COMM_SIZE) != 0) {
-		/* If we can't get the comm, use a placeholder */
-		snprintf(comm, COMM_SIZE, "<unknown>");
+	if (!comm)
+		comm = "<unknown>";
+
+	if (cpu && cpu->id >= 0 && cpu->id < config_nr_cpus)
+		log_msg("boosted pid %d (%s) (cpu %d) using %s\n", pid, comm, cpu->id, type);
+	else if (cpu)
+		log_msg("boosted pid %d (%s) (cpu <invalid>) using %s\n", pid, comm, type);
+	else
+		log_msg("boosted pid %d (%s) using %s\n", pid, comm, type);
+}
+
+int boost_with_deadline(const char *comm, int pid, struct cpu_info *cpu, uint64_t runtime)
+{
+	struct sched_attr attr;
+	int flags = 0;
+	int ret;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy   = SCHED_DEADLINE;
+	attr.sched_runtime  = runtime;
+	attr.sched_deadline = config_dl_period;
+	attr.sched_period   = config_dl_period;
+
+	ret = sched_setattr(pid, &attr, flags);
+	if (ret < 0) {
+	    /* No bandwidth left: the caller backs off. */
+	    if (errno == EBUSY)
+		log_verbose("boost_with_deadline: no bandwidth to boost pid %d\n", pid);
+	    else
+		log_msg("boost_with_deadline failed to boost pid %d: %s\n", pid, strerror(errno));
+	    return ret;
+	}
+
+	print_boosted_info(comm, pid, cpu, "SCHED_DEADLINE");
+	return ret;
+}
+
+int boost_with_fifo(const char *comm, int pid, struct cpu_info *cpu)
+{
+	struct sched_attr attr;
+	int flags = 0;
+	int ret;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy   = SCHED_FIFO;
+	attr.sched_priority = config_fifo_priority;
+
+	ret = sched_setattr(pid, &attr, flags);
+	if (ret < 0) {
+	    log_msg("boost_with_fifo failed to boost pid %d: %s\n", pid, strerror(errno));
+	    return ret;
+	}
+
+	print_boosted_info(comm, pid, cpu, "SCHED_FIFO");
+	return ret;
+}
+
+int restore_policy(int pid, struct sched_attr *attr)
+{
+	int flags = 0;
+	int ret;
+
+	ret = sched_setattr(pid, attr, flags);
+	if (ret < 0)
+		log_msg("restore_policy: failed to restore sched policy for pid %d: %s\n",
+			pid, strerror(errno));
+	return ret;
+}
+
+/*
+ * Returns true if pid has an active boost.
+ */
+static int is_boosted(int pid)
+{
+	int ret;
+
+	pthread_mutex_lock(&boosts_lock);
+	ret = boost_heap_find(&boosts, pid) >= 0;
+	pthread_mutex_unlock(&boosts_lock);
+
+	return ret;
+}
+
+/*
+ * Track a boost until it is over, see run_boosts().
+ *
+ * A SCHED_DEADLINE or fair server boost only has to be restored at its
+ * end, or once its task sleeps with --early_deboost. A SCHED_FIFO boost
+ * emulates SCHED_DEADLINE: the task is boosted for runtime, then
+ * restored for the remainder of the period, until all the periods are
+ * done. The periods are staggered by CPU, so the toggles of the tasks
+ * boosted at once are spread along the period.
+ */
+static void track_boost(struct boost *boost)
+{
+	uint64_t now = get_time_ns();
+	uint64_t nr_periods;
+
+	if (boost->policy != SCHED_FIFO) {
+		boost->boosted = 1;
+		/* The tasks of a batch end together. */
+		if (!boost->end)
+			boost->end = now + boost->duration;
+		boost->deadline = boost->end;
+		/* Check the task at each period, see run_boosts(). */
+		if (config_early_deboost && boost->policy == SCHED_DEADLINE)
+			boost->deadline = MIN(now + config_dl_period, boost->end);
+	} else {
+		nr_periods = boost->duration / config_dl_period;
+		boost->boosted = 0;
+		boost->deadline = now + (boost->cpu->id * boost->runtime) % config_dl_period;
+		boost->end = boost->deadline + nr_periods * config_dl_period;
+	}
+
+	pthread_mutex_lock(&boosts_lock);
+	boost_heap_push(&boosts, boost);
+	loop_set_deboost(boosts_loop, boost_heap_top(&boosts)->deadline);
+	pthread_mutex_unlock(&boosts_lock);
+
+	/* The pidfd is the tracked boost's now. */
+	boost->pidfd = -1;
+}
+
+/*
+ * Read the CPU time and the number of timeslices of a task, from its
+ * schedstat. Returns -1 if the task is gone.
+ */
+static int read_task_progress(struct boost *boost, uint64_t *sum_exec_runtime,
+			      uint64_t *nr_timeslices)
+{
+	unsigned long long exec, run_delay, timeslices;
+	int tgid = boost->tgid > 0 ? boost->tgid : boost->pid;
+	char buffer[128];
+
+	if (read_proc_task_file(tgid, boost->pid, "schedstat", buffer, sizeof(buffer)) < 0)
+		return -1;
+
+	if (sscanf(buffer, "%llu %llu %llu", &exec, &run_delay, &timeslices) != 3)
+		return -1;
+
+	*sum_exec_runtime = exec;
+	*nr_timeslices = timeslices;
+	return 0;
+}
+
+/*
+ * A boost is over: size the next boosts of the class of the task after
+ * the progress it made.
+ */
+static void check_boost_progress(struct boost *boost)
+{
+	int tgid = boost->tgid > 0 ? boost->tgid : boost->pid;
+	struct proc_task_stat stat;
+	uint64_t sum_exec_runtime;
+	uint64_t nr_timeslices;
+	char buffer[1024];
+
+	if (!config_adaptive_boost || boost->policy == BOOST_FAIR_SERVER)
+		return;
+
+	if (task_exited(boost->pidfd))
+		return;
+
+	/* It is ok if the task died, it does not tell anything. */
+	if (read_task_progress(boost, &sum_exec_runtime, &nr_timeslices))
+		return;
+
+	if (read_proc_task_file(tgid, boost->pid, "stat", buffer, sizeof(buffer)) < 0
+	    || parse_proc_task_stat(buffer, &stat))
+		return;
+
+	boost_adapt_size(boost, sum_exec_runtime, nr_timeslices, stat.state == 'R');
+}
+
+/*
+ * Is the boosted task still runnable? A task that died or went to sleep
+ * is not, it drained its work.
+ */
+static int boost_task_runnable(struct boost *boost)
+{
+	int tgid = boost->tgid > 0 ? boost->tgid : boost->pid;
+	struct proc_task_stat stat;
+	char buffer[1024];
+
+	if (task_exited(boost->pidfd))
+		return 0;
+
+	if (read_proc_task_file(tgid, boost->pid, "stat", buffer, sizeof(buffer)) < 0
+	    || parse_proc_task_stat(buffer, &stat))
+		return 0;
+
+	return stat.state == 'R';
+}
+
+/*
+ * With early deboost, a SCHED_DEADLINE boost is checked at each period
+ * until its end, and a SCHED_FIFO one before each toggle back to FIFO.
+ */
+static int boost_ended_early(struct boost *boost, uint64_t now)
+{
+	if (!config_early_deboost || boost->policy == BOOST_FAIR_SERVER)
+		return 0;
+
+	if (boost_task_runnable(boost))
+		return 0;
+
+	log_verbose("%s-%d went to sleep, deboosting it %.3f s early\n", boost->comm,
+		    boost->pid, (double) (boost->end - MIN(now, boost->end)) / NS_PER_SEC);
+	return 1;
+}
+
+/*
+ * Run the boosts that are due: toggle the SCHED_FIFO ones, and restore
+ * the tasks whose boost is over. With all, restore all the boosted tasks.
+ * Then set the loop's deboost timer to the next one.
+ */
+static void run_boosts(int all)
+{
+	uint64_t now = get_time_ns();
+	struct boost boost;
+
+	pthread_mutex_lock(&boosts_lock);
+
+	while (boosts.nr_boosts) {
+		if (!all && boost_heap_top(&boosts)->deadline > now)
+			break;
+
+		boost_heap_pop(&boosts, &boost);
+
+		/* Its pid can be another task's now, leave it alone. */
+		if (task_exited(boost.pidfd)) {
+			log_verbose("%s-%d exited while boosted\n", boost.comm, boost.pid);
+			if (boost.boosted)
+				boost_backoff_end = 0;
+			boost_close_pidfd(&boost);
+			continue;
+		}
+
+		if (boost.boosted && !all && boost.policy == SCHED_DEADLINE
+		    && boost.deadline < boost.end && !boost_ended_early(&boost, now)) {
+			boost.deadline = MIN(boost.deadline + config_dl_period, boost.end);
+			boost_heap_push(&boosts, &boost);
+			continue;
+		}
+
+		if (boost.boosted) {
+			if (boost.policy == BOOST_FAIR_SERVER)
+				fair_server_restore(boost.cpu->id);
+			else
+				restore_policy(boost.pid, &boost.attr);
+			/* The bandwidth of a deadline boost is back. */
+			boost_backoff_end = 0;
+			boost.boosted = 0;
+			boost.deadline += config_dl_period - boost.runtime;
+		} else if (!all) {
+			if (boost_ended_early(&boost, now)) {
+				check_boost_progress(&boost);
+				boost_close_pidfd(&boost);
+				continue;
+			}
+			if (boost_with_fifo(boost.comm, boost.pid, boost.cpu) < 0) {
+				boost_close_pidfd(&boost);
+				continue;
+			}
+			boost.boosted = 1;
+			boost.deadline += boost.runtime;
+		}
+
+		if (all) {
+			boost_close_pidfd(&boost);
+			continue;
+		}
+
+		if (boost.policy != SCHED_FIFO || (!boost.boosted && boost.deadline >= boost.end)) {
+			check_boost_progress(&boost);
+			boost_close_pidfd(&boost);
+			continue;
+		}
+
+		boost_heap_push(&boosts, &boost);
+	}
+
+	if (boosts.nr_boosts)
+		loop_set_deboost(boosts_loop, boost_heap_top(&boosts)->deadline);
+
+	pthread_mutex_unlock(&boosts_lock);
+}
+
+/*
+ * The CPUs are scanned at their own pace: the ones with nothing waiting
+ * back off exponentially, up to scan_max, the ones with tasks getting
+ * close to the starving threshold tighten toward scan_min. The tick of
+ * the main loop is set to the earliest scan, so the quiet CPUs cost fewer
+ * wakeups and parses. Protected by scan_lock, as the workers schedule the
+ * CPUs they monitor.
+ */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t scan_min;
+static uint64_t scan_max;
+static uint64_t next_tick;
+
+static void init_scan_intervals(void)
+{
+	scan_min = config_granularity / 8;
+	if (scan_min < NS_PER_MS)
+		scan_min = NS_PER_MS;
+
+	/* The aggressive mode scans each CPU at least at the granularity. */
+	scan_max = config_granularity;
+	if (!config_aggressive) {
+		scan_max = config_granularity * 8;
+		if (scan_max > config_starving_threshold / 2)
+			scan_max = config_starving_threshold / 2;
+		if (scan_max < config_granularity)
+			scan_max = config_granularity;
+	}
+}
+
+/*
+ * Is the scan of the CPU due? The scans due soon are done now, to batch
+ * them.
+ */
+static int cpu_scan_due(struct cpu_info *cpu, uint64_t now)
+{
+	return __atomic_load_n(&cpu->next_scan, __ATOMIC_RELAXED) <= now + scan_min / 2;
+}
+
+/*
+ * The time until the next scan of a CPU scanned at now. The tasks first
+ * seen in the scan can be newer than now, sampled before the parse: they
+ * just started to wait.
+ */
+uint64_t get_scan_interval(struct cpu_info *cpu, uint64_t now, int quiet)
+{
+	uint64_t interval;
+	uint64_t waited;
+	uint64_t left;
+	int i;
+
+	if (quiet || !cpu->nr_waiting_tasks) {
+		interval = cpu->scan_interval ? 2 * cpu->scan_interval : config_granularity;
+		if (interval > scan_max)
+			interval = scan_max;
+		return interval;
+	}
+
+	/*
+	 * Halve the time left before a task starves. The tasks past the
+	 * threshold were already reported, they do not count.
+	 */
+	interval = config_granularity;
+	for (i = 0; i < cpu->nr_waiting_tasks; i++) {
+		waited = now > cpu->starving[i].since ? now - cpu->starving[i].since : 0;
+		if (waited >= config_starving_threshold)
+			continue;
+
+		left = (config_starving_threshold - waited) / 2;
+		if (left < interval)
+			interval = left;
+	}
+
+	if (interval < scan_min)
+		interval = scan_min;
+
+	return interval;
+}
+
+/*
+ * Schedule the next scan of a CPU just scanned, or skipped because it was
+ * quiet: idle, or nothing to parse.
+ */
+static void schedule_cpu_scan(struct cpu_info *cpu, uint64_t now, int quiet)
+{
+	uint64_t interval = get_scan_interval(cpu, now, quiet);
+
+	pthread_mutex_lock(&scan_lock);
+	cpu->scan_interval = interval;
+	__atomic_store_n(&cpu->next_scan, now + interval, __ATOMIC_RELAXED);
+	if (cpu->next_scan < next_tick) {
+		next_tick = cpu->next_scan;
+		loop_set_tick_at(boosts_loop, next_tick);
+	}
+	pthread_mutex_unlock(&scan_lock);
+}
+
+/*
+ * Set the tick of the main loop to the earliest scan. The CPUs due now are
+ * being scanned, and schedule themselves.
+ */
+static void set_next_tick(struct cpu_info *cpus, int nr_cpus, uint64_t now)
+{
+	uint64_t tick = now + scan_max;
+	int i;
+
+	pthread_mutex_lock(&scan_lock);
+
+	for_each_cpu(i, &monitored_cpus) {
+		if (cpu_scan_due(&cpus[i], now))
+			continue;
+		if (cpus[i].next_scan < tick)
+			tick = cpus[i].next_scan;
+	}
+
+	next_tick = tick;
+	loop_set_tick_at(boosts_loop, next_tick);
+
+	pthread_mutex_unlock(&scan_lock);
+}
+
+/*
+ * The CPUs to monitor are the CPUs of config_monitored_cpus that are
+ * online.
+ */
+static void init_monitored_cpus(void)
+{
+	if (config_monitor_all_cpus) {
+		cpumask_init(&config_monitored_cpus, config_nr_cpus);
+		cpumask_setall(&config_monitored_cpus);
+	}
+
+	cpumask_init(&online_cpus, config_nr_cpus);
+	if (!cpumask_read(&online_cpus, "/sys/devices/system/cpu/online"))
+		cpumask_setall(&online_cpus);
+
+	cpumask_init(&monitored_cpus, config_nr_cpus);
+	cpumask_and(&monitored_cpus, &config_monitored_cpus, &online_cpus);
+}
+
+/*
+ * Follow the CPU hotplug: start monitoring the CPUs that came online, and
+ * stop monitoring the ones that went offline. The per-CPU state is sized
+ * for the possible CPUs, so it only has to be reset.
+ */
+static void update_online_cpus(struct cpu_info *cpus)
+{
+	struct cpu_info *cpu;
+	int online;
+	int i;
+
+	cpumask_clear(&online_cpus);
+	if (!cpumask_read(&online_cpus, "/sys/devices/system/cpu/online")) {
+		cpumask_setall(&online_cpus);
+		return;
+	}
+
+	for_each_cpu(i, &config_monitored_cpus) {
+		online = cpumask_test_cpu(i, &online_cpus);
+		if (online == cpumask_test_cpu(i, &monitored_cpus))
+			continue;
+
+		cpu = &cpus[i];
+
+		if (online) {
+			log_msg("cpu %d is online, monitoring it\n", i);
+			cpumask_set_cpu(i, &monitored_cpus);
+			cpu->idle_time = -1;
+			cpu->nr_waiting_tasks = 0;
+			__atomic_store_n(&cpu->next_scan, 0, __ATOMIC_RELAXED);
+			/* The aggressive mode workers monitor all the CPUs. */
+			if (config_aggressive)
+				cpu->thread_running = 1;
+		} else {
+			log_msg("cpu %d is offline, not monitoring it\n", i);
+			cpumask_clear_cpu(i, &monitored_cpus);
+			cpu->thread_running = 0;
+			if (cpu_starving_vector)
+				reset_cpu_starving_vector(i);
+		}
+
+		if (backend->set_cpu_monitoring)
+			backend->set_cpu_monitoring(i, online);
+	}
+}
+
+/*
+ * Wait for the next scan, restoring the boosted tasks meanwhile. A
+ * SIGHUP makes all the CPUs due, and a CPU coming online is due at once.
+ */
+static void wait_next_scan(struct stalld_loop *loop, struct cpu_info *cpus, int nr_cpus, uint64_t now)
+{
+	int events;
+	int i;
+
+	set_next_tick(cpus, nr_cpus, now);
+
+	do {
+		events = loop_wait(loop);
+		if (events & LOOP_DEBOOST)
+			run_boosts(0);
+	} while (!(events & (LOOP_TICK | LOOP_RESCAN | LOOP_HOTPLUG | LOOP_SHUTDOWN)));
+
+	if (events & (LOOP_RESCAN | LOOP_HOTPLUG))
+		update_online_cpus(cpus);
+
+	if (events & LOOP_RESCAN)
+		for (i = 0; i < nr_cpus; i++)
+			__atomic_store_n(&cpus[i].next_scan, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * The latest end of a boost starting now, with the stagger of the
+ * SCHED_FIFO periods, for the noise budget.
+ */
+static uint64_t get_boost_end(const struct boost *boost)
+{
+	return get_time_ns() + boost->duration + config_dl_period;
+}
+
+/*
+ * Boost the fair server of the CPU of a starving fair task, for all the
+ * fair tasks of the CPU. Returns 0 if boosted, 1 if the server of the CPU
+ * is already boosted, 2 if the server already has the bandwidth of a boost
+ * and the task has to be boosted on its own, -1 on failure.
+ */
+static int boost_with_fair_server(struct boost *task)
+{
+	struct boost boost;
+	uint64_t noise;
+	uint64_t end;
+	int ret;
+
+	memset(&boost, 0, sizeof(boost));
+	boost.pidfd = -1;
+	boost.policy = BOOST_FAIR_SERVER;
+	boost.cpu = task->cpu;
+	boost.runtime = config_dl_runtime;
+	boost.duration = config_boost_duration;
+	snprintf(boost.comm, sizeof(boost.comm), "fair_server");
+
+	pthread_mutex_lock(&boosts_lock);
+
+	if (fair_server_boosted(task->cpu->id)) {
+		pthread_mutex_unlock(&boosts_lock);
+		return 1;
+	}
+
+	noise = boost_noise(&boost);
+	end = get_boost_end(&boost);
+	if (noise_budget_charge(task->cpu->id, noise, get_time_ns(), end)) {
+		pthread_mutex_unlock(&boosts_lock);
+		return 1;
+	}
+
+	ret = fair_server_boost(task->cpu->id, config_dl_runtime, config_dl_period);
+	if (ret)
+		noise_budget_refund(task->cpu->id, noise, end);
+
+	pthread_mutex_unlock(&boosts_lock);
+
+	if (ret)
+		return ret > 0 ? 2 : ret;
+
+	track_boost(&boost);
+	return 0;
+}
+
+static int is_fair_policy(int policy)
+{
+	return policy == SCHED_OTHER || policy == SCHED_BATCH || policy == SCHED_IDLE;
+}
+
+/*
+ * Boost the task with the boost_policy, the main loop restores it at the
+ * end. Returns 0 if boosted, 1 if the boost of its CPU covers it already
+ * or its CPU is out of noise budget, and -1 on failure.
+ */
+static int boost_starving_task(struct boost *boost)
+{
+	struct sched_attr attr;
+	uint64_t noise;
+	uint64_t end;
+	int ret;
+
+	/* Its pid can be another task's now. */
+	if (task_exited(boost->pidfd)) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	/*
+	 * Get the old prio, to be restored at the end of the
+	 * boosting period.
+	 */
+	ret = get_current_policy(boost->pid, &attr);
+	if (ret < 0)
+		return ret;
+
+	if (config_fair_server && boost->cpu && is_fair_policy(attr.sched_policy)) {
+		ret = boost_with_fair_server(boost);
+		if (ret < 2)
+			return ret;
+	}
+
+	pthread_mutex_lock(&boosts_lock);
+	/* The tasks of a batch come sized. */
+	if (!boost->end)
+		boost_get_size(boost);
+	noise = boost_noise(boost);
+	end = get_boost_end(boost);
+	ret = noise_budget_charge(boost->cpu->id, noise, get_time_ns(), end);
+	pthread_mutex_unlock(&boosts_lock);
+
+	/* Deferred: it is queued again while it starves. */
+	if (ret)
+		return 1;
+
+	if (config_adaptive_boost && read_task_progress(boost, &boost->sum_exec_runtime,
+							&boost->nr_timeslices)) {
+		ret = -1;
+		goto out_refund;
+	}
+
+	/* The SCHED_FIFO toggles start from the loop. */
+	if (boost_policy == SCHED_DEADLINE) {
+		ret = boost_with_deadline(boost->comm, boost->pid, boost->cpu, boost->runtime);
+		if (ret < 0)
+			goto out_refund;
+	}
+
+	boost->policy = boost_policy;
+	boost->attr = attr;
+	track_boost(boost);
+	return 0;
+
+out_refund:
+	pthread_mutex_lock(&boosts_lock);
+	noise_budget_refund(boost->cpu->id, noise, end);
+	pthread_mutex_unlock(&boosts_lock);
+	return ret;
+}
+
+/*
+ * Queue a task that starved for longer than the threshold, to be boosted
+ * by boost_starving_tasks(). The task is held by a pidfd from now on, if
+ * the kernel has them, not to boost another task that got its pid.
+ */
+static void queue_starving_task(const struct task_info *task, struct cpu_info *cpu)
+{
+	struct boost boost = {
+		.deadline = task->since,
+		.tgid = task->tgid,
+		.pid = task->pid,
+		.cpu = cpu,
+	};
+
+	memcpy(boost.comm, task->comm, COMM_SIZE);
+
+	pthread_mutex_lock(&boosts_lock);
+	if (boost_heap_find(&starving_tasks, task->pid) < 0) {
+		boost.pidfd = open_task_pidfd(task->tgid, task->pid);
+		/* Unless it died already. */
+		if (boost.pidfd >= 0 || errno != ESRCH)
+			boost_heap_push(&starving_tasks, &boost);
+	}
+	pthread_mutex_unlock(&boosts_lock);
+}
+
+/*
+ * Forget the queued tasks: they are queued again while they starve.
+ */
+static void reset_starving_tasks(void)
+{
+	pthread_mutex_lock(&boosts_lock);
+	boost_heap_reset(&starving_tasks);
+	pthread_mutex_unlock(&boosts_lock);
+}
+
+/*
+ * The runtime per period of the boosts of the CPU, active or being set up
+ * in a batch. Called with the boosts_lock held.
+ */
+static uint64_t get_cpu_boost_runtime(struct cpu_info *cpu)
+{
+	uint64_t runtime = batch_runtime[cpu->id];
+	struct boost *boost;
+	int i;
+
+	for (i = 0; i < boosts.nr_boosts; i++) {
+		boost = &boosts.boosts[i];
+		if (boost->cpu == cpu && boost->policy != SCHED_FIFO)
+			runtime += boost->runtime;
 	}
 
-	if (cpu && cpu->id >= 0 && cpu->id < config_nr_cpus)
-		log_msg("boosted pid %d (%s) (cpu %d) using %s\n", pid, comm, cpu->id, type);
-	else if (cpu)
-		log_msg("boosted pid %d (%s) (cpu <invalid>) using %s\n", pid, comm, type);
-	else
-		log_msg("boosted pid %d (%s) using %s\n", pid, comm, type);
+	return runtime;
 }
 
-int boost_with_deadline(int tgid, int pid, struct cpu_info *cpu)
+static int compare_since(const void *a, const void *b)
 {
-	struct sched_attr attr;
-	int flags = 0;
-	int ret;
-
-	memset(&attr, 0, sizeof(attr));
-	attr.size = sizeof(attr);
-	attr.sched_policy   = SCHED_DEADLINE;
-	attr.sched_runtime  = config_dl_runtime;
-	attr.sched_deadline = config_dl_period;
-	attr.sched_period   = config_dl_period;
+	const struct boost *ba = a;
+	const struct boost *bb = b;
 
-	ret = sched_setattr(pid, &attr, flags);
-	if (ret < 0) {
-	    log_msg("boost_with_deadline failed to boost pid %d: %s\n", pid, strerror(errno));
-	    return ret;
-	}
-
-	print_boosted_info(tgid, pid, cpu, "SCHED_DEADLINE");
-	return ret;
+	return ba->deadline < bb->deadline ? -1 : ba->deadline > bb->deadline;
 }
 
-int boost_with_fifo(int tgid, int pid, struct cpu_info *cpu)
+/*
+ * Make a batch of the first task and the other queued tasks of its CPU,
+ * the ones that starved the longest first, up to max_tasks; the others
+ * stay queued. The tasks share what is left of the batch runtime of the
+ * CPU, and end together, after the longest of their durations. The tasks
+ * the runtime cannot fit are dropped, they are queued again while they
+ * starve. Called with the boosts_lock held. Returns the number of tasks
+ * to boost.
+ */
+static int get_batch(struct boost *batch, int max_tasks)
 {
-	struct sched_attr attr;
-	int flags = 0;
-	int ret;
+	struct cpu_info *cpu = batch[0].cpu;
+	uint64_t duration = 0;
+	uint64_t share;
+	uint64_t used;
+	uint64_t left;
+	uint64_t now;
+	int nr_tasks = 1;
+	int i;
 
-	memset(&attr, 0, sizeof(attr));
-	attr.size = sizeof(attr);
-	attr.sched_policy   = SCHED_FIFO;
-	attr.sched_priority = config_fifo_priority;
+	nr_tasks += boost_heap_remove_cpu(&starving_tasks, cpu, &batch[1]);
 
-	ret = sched_setattr(pid, &attr, flags);
-	if (ret < 0) {
-	    log_msg("boost_with_fifo failed to boost pid %d: %s\n", pid, strerror(errno));
-	    return ret;
+	qsort(batch + 1, nr_tasks - 1, sizeof(*batch), compare_since);
+
+	for (i = nr_tasks - 1; i >= max_tasks; i--)
+		boost_heap_push(&starving_tasks, &batch[i]);
+	if (nr_tasks > max_tasks)
+		nr_tasks = max_tasks;
+
+	used = get_cpu_boost_runtime(cpu);
+	left = config_batch_boost > used ? config_batch_boost - used : 0;
+
+	for (i = left / MIN_BOOST_RUNTIME; i < nr_tasks; i++)
+		boost_close_pidfd(&batch[i]);
+	if (nr_tasks > left / MIN_BOOST_RUNTIME)
+		nr_tasks = left / MIN_BOOST_RUNTIME;
+
+	if (!nr_tasks) {
+		log_verbose("no batch runtime left on cpu %d\n", cpu->id);
+		return 0;
 	}
 
-	print_boosted_info(tgid, pid, cpu, "SCHED_FIFO");
-	return ret;
-}
+	share = left / nr_tasks;
 
-int restore_policy(int pid, struct sched_attr *attr)
-{
-	int flags = 0;
-	int ret;
+	for (i = 0; i < nr_tasks; i++) {
+		boost_get_size(&batch[i]);
+		duration = MAX(duration, batch[i].duration);
+	}
 
-	ret = sched_setattr(pid, attr, flags);
-	if (ret < 0)
-		log_msg("restore_policy: failed to restore sched policy for pid %d: %s\n",
-			pid, strerror(errno));
-	return ret;
+	now = get_time_ns();
+	for (i = 0; i < nr_tasks; i++) {
+		batch[i].runtime = MIN(batch[i].runtime, share);
+		batch[i].duration = duration;
+		batch[i].end = now + duration;
+		batch_runtime[cpu->id] += batch[i].runtime;
+	}
+
+	log_verbose("boosting %d tasks of cpu %d at once\n", nr_tasks, cpu->id);
+
+	return nr_tasks;
 }
 
 /*
- * This function emulates the behavior of SCHED_DEADLINE but using SCHED_FIFO
- * by boosting the thread, sleeping for runtime, changing the pid policy
- * back to its old policy, then sleeping for the remainder of the period,
- * repeating until all the periods are done.
+ * The tasks being boosted by boost_starving_tasks(), as many as the queued
+ * ones. Like the merge hash, it is reused across the passes, one per
+ * thread, as the monitors boost their tasks concurrently.
  */
-void do_fifo_boost(int tgid, int pid, struct sched_attr *old_attr, struct cpu_info *cpu)
+static __thread struct boost *batch_array;
+static __thread int batch_array_size;
+
+static struct boost *get_batch_array(int nr_tasks)
 {
-	uint64_t nr_periods = (config_boost_duration * NS_PER_SEC) / config_dl_period;
-	struct timespec remainder_ts;
-	struct timespec runtime_ts;
-	struct timespec ts;
-	uint64_t i;
-
-	/* Setup the runtime sleep. */
-	memset(&runtime_ts, 0, sizeof(runtime_ts));
-	runtime_ts.tv_nsec = config_dl_runtime;
-	normalize_timespec(&runtime_ts);
-
-	/* Setup the remainder of the period sleep. */
-	memset(&remainder_ts, 0, sizeof(remainder_ts));
-	remainder_ts.tv_nsec = config_dl_period - config_dl_runtime;
-	normalize_timespec(&remainder_ts);
-
-	for (i=0; i < nr_periods; i++) {
-		boost_with_fifo(tgid, pid, cpu);
-		ts = runtime_ts;
-		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, 0);
-		restore_policy(pid, old_attr);
-		ts = remainder_ts;
-		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, 0);
+	if (nr_tasks > batch_array_size) {
+		free(batch_array);
+		batch_array = allocate_memory(nr_tasks, sizeof(*batch_array));
+		batch_array_size = nr_tasks;
 	}
+
+	return batch_array;
 }
 
-int boost_starving_task(int tgid, int pid, struct cpu_info *cpu)
+/*
+ * Boost the queued tasks, the ones that starved the longest first, up to
+ * config_max_boosts concurrent boosts. When the admission control refuses
+ * a SCHED_DEADLINE boost, back off, exponentially, until a boost ends or
+ * the back-off expires. Returns the number of tasks boosted.
+ */
+static int boost_starving_tasks(void)
 {
-	struct sched_attr attr;
+	struct boost *batch;
+	int boosted = 0;
+	int max_tasks;
+	int nr_tasks;
+	uint64_t now;
+	int error;
+	int busy;
 	int ret;
+	int i;
 
-	/*
-	 * Get the old prio, to be restored at the end of the
-	 * boosting period.
-	 */
-	ret = get_current_policy(pid, &attr);
-	if (ret < 0)
-		return ret;
-
-	/* Boost. */
-	if (boost_policy == SCHED_DEADLINE) {
-		ret = boost_with_deadline(tgid, pid, cpu);
-		if (ret < 0)
-			return ret;
-		sleep(config_boost_duration);
-		ret = restore_policy(pid, &attr);
-		if (ret < 0)
-			return ret;
-	} else {
-		do_fifo_boost(tgid, pid, &attr, cpu);
-	}
+	for (;;) {
+		pthread_mutex_lock(&boosts_lock);
 
-	/*
-	 * XXX: If the proccess dies, we get an error. Deal with that
-	 * latter.
-	 * if (ret < 0)
-	 *   die("sched_setattr failed to set the normal priorities");
-	 */
+		now = get_time_ns();
+		if (!starving_tasks.nr_boosts
+		    || (config_max_boosts && boosts.nr_boosts + nr_boosting >= config_max_boosts)
+		    || now < boost_backoff_end) {
+			pthread_mutex_unlock(&boosts_lock);
+			break;
+		}
 
-	return 0;
+		max_tasks = config_batch_boost ? starving_tasks.nr_boosts : 1;
+		if (config_max_boosts && max_tasks > config_max_boosts - boosts.nr_boosts - nr_boosting)
+			max_tasks = config_max_boosts - boosts.nr_boosts - nr_boosting;
+
+		batch = get_batch_array(starving_tasks.nr_boosts);
+
+		boost_heap_pop(&starving_tasks, &batch[0]);
+		nr_tasks = 1;
+		if (config_batch_boost)
+			nr_tasks = get_batch(batch, max_tasks);
+		nr_boosting += nr_tasks;
+
+		pthread_mutex_unlock(&boosts_lock);
+
+		busy = 0;
+		for (i = 0; i < nr_tasks; i++) {
+			/* Once out of bandwidth, the rest is queued again while it starves. */
+			ret = busy ? 1 : boost_starving_task(&batch[i]);
+			error = errno;
+			boost_close_pidfd(&batch[i]);
+
+			pthread_mutex_lock(&boosts_lock);
+			nr_boosting--;
+			if (config_batch_boost)
+				batch_runtime[batch[i].cpu->id] -= batch[i].runtime;
+			if (ret < 0 && error == EBUSY) {
+				busy = 1;
+				boost_backoff = boost_backoff ? 2 * boost_backoff : config_dl_period;
+				if (boost_backoff > config_boost_duration)
+					boost_backoff = config_boost_duration;
+				boost_backoff_end = now + boost_backoff;
+				log_msg("no SCHED_DEADLINE bandwidth left, backing off for %.3f seconds\n",
+					ns_to_sec(boost_backoff));
+			} else if (!ret) {
+				boost_backoff = 0;
+				boosted++;
+			}
+			pthread_mutex_unlock(&boosts_lock);
+		}
+	}
 
+	return boosted;
 }
 
 /*
@@ -640,18 +1596,24 @@ int check_starving_tasks(struct cpu_info *cpu)
 	struct task_info *tasks = cpu->starving;
 	struct task_info *task;
 	int starving = 0;
+	uint64_t now;
 	int i;
 
 	for (i = 0; i < cpu->nr_waiting_tasks; i++) {
 		task = &tasks[i];
+		now = get_time_ns();
 
 		/* Skip tasks that haven't been starving long enough */
-		if ((time(NULL) - task->since) < config_starving_threshold)
+		if ((now - task->since) < config_starving_threshold)
+			continue;
+
+		/* Skip tasks that are already boosted */
+		if (is_boosted(task->pid))
 			continue;
 
-		log_msg("%s-%d starved on CPU %d for %d seconds\n",
+		log_msg("%s-%d starved on CPU %d for %.3f seconds\n",
 			task->comm, task->pid, cpu->id,
-			(time(NULL) - task->since));
+			ns_to_sec(now - task->since));
 
 		/*
 		 * Check if this task needs to be ignored from being boosted
@@ -659,7 +1621,7 @@ int check_starving_tasks(struct cpu_info *cpu)
 		 * getting reported as being starved.
 		 */
 		if (config_ignore && !(check_task_ignore(task))) {
-			task->since = time(NULL);
+			task->since = now;
 			continue;
 		}
 
@@ -670,13 +1632,16 @@ int check_starving_tasks(struct cpu_info *cpu)
 		 * after logging.
 		 */
 		if (config_log_only) {
-			task->since = time(NULL);
+			task->since = now;
 			continue;
 		}
 
-		boost_starving_task(task->tgid, task->pid, cpu);
+		queue_starving_task(task, cpu);
 	}
 
+	if (starving)
+		boost_starving_tasks();
+
 	return starving;
 }
 
@@ -685,19 +1650,22 @@ int check_might_starve_tasks(struct cpu_info *cpu)
 	struct task_info *tasks = cpu->starving;
 	struct task_info *task;
 	int starving = 0;
+	uint64_t now;
 	int i;
 
 	if (cpu->thread_running)
 		warn("checking a running thread!!!???");
 
+	now = get_time_ns();
+
 	for (i = 0; i < cpu->nr_waiting_tasks; i++) {
 		task = &tasks[i];
 
-		if ((time(NULL) - task->since) >= config_starving_threshold/2) {
+		if ((now - task->since) >= config_starving_threshold/2) {
 
-			log_msg("%s-%d might starve on CPU %d (waiting for %d seconds)\n",
+			log_msg("%s-%d might starve on CPU %d (waiting for %.3f seconds)\n",
 				task->comm, task->pid, cpu->id,
-				(time(NULL) - task->since));
+				ns_to_sec(now - task->since));
 
 			starving = 1;
 		}
@@ -729,321 +1697,383 @@ static int get_cpu_and_parse(struct cpu_info *cpu, char *buffer, int buffer_size
 	return 0;
 }
 
-static int cpu_main_parse_starving_task(struct cpu_info *cpu)
+/*
+ * Parse the CPU out of the snapshot, or out of the backend for the
+ * backends with per-CPU data.
+ */
+static int parse_snapshot(struct cpu_info *cpu, struct stalld_snapshot *snapshot)
 {
-	int retval;
-
-	if (backend->get) {
-		retval = backend->get(cpu->buffer, cpu->buffer_size);
-		if(!retval) {
-			warn("fail reading backend");
-			warn("Dazed and confused, but trying to continue");
-			return 1;
-		}
+	if (backend->get_cpu) {
+		/* Buffer size should increase. See sched_debug_get(). */
+		resize_buffer_if_needed(&cpu->buffer, &cpu->buffer_size);
+		return get_cpu_and_parse(cpu, cpu->buffer, cpu->buffer_size);
 	}
 
-	return get_cpu_and_parse(cpu, cpu->buffer, cpu->buffer_size);
+	return get_cpu_and_parse(cpu, snapshot->buffer, snapshot->buffer_size);
 }
 
-void *cpu_main(void *data)
+/*
+ * One cycle of the monitor of a CPU, run by the worker pool on the
+ * snapshot of the cycle.
+ */
+static int cpu_monitor(struct cpu_info *cpu)
 {
-	struct cpu_info *cpu = data;
-	int nothing_to_do = 0;
-	int retval;
+	struct stalld_snapshot *snapshot;
+	uint64_t now = get_time_ns();
+	int retval = 0;
 
-	while (cpu->thread_running && running) {
+	/* Not its turn yet: it still counts as busy if it had waiting tasks. */
+	if (!cpu_scan_due(cpu, now))
+		return !!cpu->nr_waiting_tasks;
 
-		/* Buffer size should increase. See sched_debug_get(). */
-		resize_buffer_if_needed(&cpu->buffer, &cpu->buffer_size);
-
-		if (config_idle_detection) {
-			if (cpu_had_idle_time(cpu)) {
-				log_verbose("cpu %d had idle time! skipping next phase\n", cpu->id);
-				nothing_to_do++;
-				goto skipped;
-			}
-		}
+	snapshot = snapshot_get();
+	if (!snapshot)
+		return 0;
 
-		retval = cpu_main_parse_starving_task(cpu);
-		if (retval)
-			goto skipped;
+	/* Already parsed, or the backend could not be read. */
+	if (cpu->snapshot_version == snapshot->version)
+		goto out_put;
 
-		print_waiting_tasks(cpu);
+	if (backend->get && !snapshot->size) {
+		retval = -1;
+		goto out_put;
+	}
 
-		if (backend->has_starving_task(cpu)) {
-			nothing_to_do = 0;
-			check_starving_tasks(cpu);
-		} else {
-			nothing_to_do++;
-		}
+	cpu->snapshot_version = snapshot->version;
 
-skipped:
-		/*
-		 * It not in aggressive mode, give up after 10 cycles with
-		 * nothing to do.
-		 */
-		if (!config_aggressive && nothing_to_do == 10) {
-			cpu->thread_running=0;
-			pthread_exit(NULL);
+	if (config_idle_detection) {
+		if (cpu_had_idle_time(cpu, snapshot)) {
+			log_verbose("cpu %d had idle time! skipping next phase\n", cpu->id);
+			schedule_cpu_scan(cpu, now, 1);
+			goto out_put;
 		}
+	}
 
-		sleep(config_granularity);
+	if (parse_snapshot(cpu, snapshot)) {
+		schedule_cpu_scan(cpu, now, 1);
+		retval = -1;
+		goto out_put;
 	}
 
-	return NULL;
-}
+	schedule_cpu_scan(cpu, now, 0);
 
-static const char *join_thread(pthread_t *thread)
-{
-	void *result;
+	print_waiting_tasks(cpu);
+
+	if (!backend->has_starving_task(cpu))
+		goto out_put;
 
-	pthread_join(*thread, &result);
+	check_starving_tasks(cpu);
+	retval = 1;
 
-	return result;
+out_put:
+	snapshot_put(snapshot);
+	return retval;
 }
 
 /*
- * Check if idle detection should skip parsing.
+ * Check if idle detection and the run_delay filter should skip parsing.
+ * The CPUs to parse are set in busy_cpu_list.
  * Returns 1 if parsing should be skipped, 0 otherwise.
  */
-static int should_skip_idle_cpus(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list)
+static int should_skip_idle_cpus(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list,
+				 struct stalld_snapshot *snapshot)
 {
 	int has_busy_cpu;
 
-	if (!config_idle_detection)
-		return 0;
+	memset(busy_cpu_list, 1, nr_cpus);
 
-	memset(busy_cpu_list, 0, nr_cpus);
-	has_busy_cpu = get_cpu_busy_list(cpus, nr_cpus, busy_cpu_list);
-	if (!has_busy_cpu) {
-		log_verbose("all CPUs had idle time, skipping parse\n");
-		return 1;
+	if (config_idle_detection) {
+		memset(busy_cpu_list, 0, nr_cpus);
+		has_busy_cpu = get_cpu_busy_list(cpus, nr_cpus, busy_cpu_list, snapshot);
+		if (!has_busy_cpu) {
+			log_verbose("all CPUs had idle time, skipping parse\n");
+			return 1;
+		}
+	}
+
+	if (config_run_delay_filter) {
+		has_busy_cpu = get_cpu_delayed_list(cpus, nr_cpus, busy_cpu_list);
+		if (!has_busy_cpu) {
+			log_verbose("no busy CPU had run-queue delay, skipping parse\n");
+			return 1;
+		}
 	}
+
 	log_verbose("some cpus ran, so run-queues should be parsed\n");
 	return 0;
 }
 
-void aggressive_main(struct cpu_info *cpus, int nr_cpus)
+/*
+ * Keep in busy_cpu_list the CPUs this thread has to parse now, those whose
+ * scan is due. The due CPUs found quiet are scheduled here. Returns the
+ * number of CPUs to parse.
+ */
+static int filter_due_cpus(struct cpu_info *cpus, int nr_cpus, char *busy_cpu_list, uint64_t now)
 {
+	struct cpu_info *cpu;
+	int count = 0;
 	int i;
 
-	for (i = 0; i < nr_cpus; i++) {
-		if (!should_monitor(i))
+	for_each_cpu(i, &monitored_cpus) {
+		cpu = &cpus[i];
+
+		if (cpu->thread_running || !cpu_scan_due(cpu, now)) {
+			busy_cpu_list[i] = 0;
 			continue;
+		}
 
-		cpus[i].id = i;
-		cpus[i].thread_running = 1;
-		pthread_create(&cpus[i].thread, NULL, cpu_main, &cpus[i]);
+		if (!busy_cpu_list[i]) {
+			schedule_cpu_scan(cpu, now, 1);
+			continue;
+		}
+
+		count++;
 	}
 
-	for (i = 0; i < nr_cpus; i++) {
-		if (!should_monitor(i))
-			continue;
+	return count;
+}
+
+void aggressive_main(struct cpu_info *cpus, int nr_cpus)
+{
+	struct stalld_snapshot *snapshot;
+	struct stalld_loop loop;
+	uint64_t now;
+	int i;
+
+	if (loop_init(&loop, 1) || loop_set_tick(&loop, config_granularity))
+		die("cannot set up the event loop");
+
+	boosts_loop = &loop;
+	init_scan_intervals();
+
+	for_each_cpu(i, &monitored_cpus)
+		cpus[i].thread_running = 1;
+
+	worker_pool_start(cpus, nr_cpus, cpu_monitor, 1);
 
-		join_thread(&cpus[i].thread);
+	/*
+	 * The workers monitor the CPUs out of the snapshot this thread takes
+	 * at each cycle, and this thread handles the events.
+	 */
+	while (running) {
+		now = get_time_ns();
+		snapshot = snapshot_new();
+		snapshot_read_backend(snapshot);
+		snapshot_publish(snapshot);
+		snapshot_put(snapshot);
+
+		reset_starving_tasks();
+		worker_pool_kick();
+		wait_next_scan(&loop, cpus, nr_cpus, now);
 	}
+
+	worker_pool_stop();
+	snapshot_destroy();
+	run_boosts(1);
+	loop_destroy(&loop);
+}
+
+/*
+ * The CPUs monitored by the worker pool due for a scan.
+ */
+static int count_pool_cpus(struct cpu_info *cpus, int nr_cpus, uint64_t now)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < nr_cpus; i++)
+		if (cpus[i].thread_running && cpu_scan_due(&cpus[i], now))
+			count++;
+
+	return count;
 }
 
 void conservative_main(struct cpu_info *cpus, int nr_cpus)
 {
+	struct stalld_snapshot *snapshot;
 	char busy_cpu_list[nr_cpus];
-	pthread_attr_t dettached;
-	size_t buffer_size = 0;
+	struct stalld_loop loop;
 	struct cpu_info *cpu;
-	char *buffer = NULL;
-	int retval;
+	uint64_t now;
+	int skip;
 	int i;
 
-	buffer = allocate_memory(config_buffer_size, sizeof *buffer);
-	buffer_size = config_buffer_size;
+	if (loop_init(&loop, 1) || loop_set_tick(&loop, config_granularity))
+		die("cannot set up the event loop");
 
-	pthread_attr_init(&dettached);
-	pthread_attr_setdetachstate(&dettached, PTHREAD_CREATE_DETACHED);
+	boosts_loop = &loop;
+	init_scan_intervals();
 
-	for (i = 0; i < nr_cpus; i++) {
-		cpus[i].id = i;
+	for (i = 0; i < nr_cpus; i++)
 		cpus[i].thread_running = 0;
-	}
 
-	while (running) {
+	worker_pool_start(cpus, nr_cpus, cpu_monitor, 0);
 
-		/* Buffer size should increase. See sched_debug_get(). */
-		resize_buffer_if_needed(&buffer, &buffer_size);
+	while (running) {
+		now = get_time_ns();
+		snapshot = snapshot_new();
 
-		if (should_skip_idle_cpus(cpus, nr_cpus, busy_cpu_list))
+		/*
+		 * The backend is read once for this thread and the workers,
+		 * unless no CPU needs to be parsed.
+		 */
+		should_skip_idle_cpus(cpus, nr_cpus, busy_cpu_list, snapshot);
+		skip = !filter_due_cpus(cpus, nr_cpus, busy_cpu_list, now);
+		if (skip && !count_pool_cpus(cpus, nr_cpus, now))
 			goto skipped;
 
-		if (backend->get) {
-			retval = backend->get(buffer, buffer_size);
-			if (!retval) {
-				warn("Dazed and confused, but trying to continue");
-				continue;
-			}
+		if (!snapshot_read_backend(snapshot)) {
+			warn("Dazed and confused, but trying to continue");
+			skip = 1;
 		}
 
-		for (i = 0; i < nr_cpus; i++) {
-			if (!should_monitor(i))
-				continue;
+		snapshot_publish(snapshot);
+
+		for_each_cpu(i, &monitored_cpus) {
+			if (skip)
+				break;
 
 			cpu = &cpus[i];
 
-			if (cpu->thread_running)
+			if (!busy_cpu_list[i])
 				continue;
 
-			if (config_idle_detection && !busy_cpu_list[i])
+			if (parse_snapshot(cpu, snapshot)) {
+				schedule_cpu_scan(cpu, now, 1);
 				continue;
+			}
 
-			retval = get_cpu_and_parse(cpu, buffer, buffer_size);
-			if (retval)
-				continue;
+			schedule_cpu_scan(cpu, now, 0);
 
 			info("\tchecking cpu %d - rt: %d - starving: %d\n",
 			     i, cpu->nr_rt_running, cpu->nr_waiting_tasks);
 
-			if (check_might_starve_tasks(cpu)) {
-				cpus[i].id = i;
-				cpus[i].thread_running = 1;
-				pthread_create(&cpus[i].thread, &dettached, cpu_main, &cpus[i]);
-			}
+			/* Hand the CPU over to the worker pool. */
+			if (check_might_starve_tasks(cpu))
+				cpu->thread_running = 1;
 		}
 
 skipped:
-		sleep(config_granularity);
+		snapshot_put(snapshot);
+		reset_starving_tasks();
+		worker_pool_kick();
+		wait_next_scan(&loop, cpus, nr_cpus, now);
 	}
-	if (buffer)
-		free(buffer);
+	worker_pool_stop();
+	snapshot_destroy();
+	run_boosts(1);
+	loop_destroy(&loop);
 }
 
+/*
+ * Boost the starving tasks of the vector, all the ones that starved
+ * for longer than the threshold, the oldest first. The boosts are restored
+ * by the loop at their deadline, so the detection keeps going meanwhile.
+ */
 int boost_cpu_starving_vector(struct cpu_starving_task_info *vector, int nr_cpus, struct cpu_info *cpus)
 {
 	struct cpu_starving_task_info *cpu;
-	struct sched_attr attr[nr_cpus];
-	int deboost_vector[nr_cpus];
-	int boosted = 0;
-	time_t now;
-	int ret;
+	struct task_info *task;
+	int starving = 0;
+	uint64_t now;
 	int i;
+	int j;
 
-	now = time(NULL);
-
-	/* Boost phase. */
-	for (i = 0; i < nr_cpus; i++) {
+	now = get_time_ns();
 
-		/* Clear the deboost vector for this CPU. */
-		deboost_vector[i] = 0;
+	reset_starving_tasks();
 
+	for_each_cpu(i, &monitored_cpus) {
 		cpu = &cpu_starving_vector[i];
 
-		if (cpu->pid)
-			log_verbose("\t cpu %d: pid: %d starving for %llu\n",
-				    i, cpu->pid, (now - cpu->since));
+		for (j = 0; j < cpu->nr_tasks; j++) {
+			task = &cpu->tasks[j];
 
-		/* Skip if no task or not starving long enough */
-		if (cpu->pid == 0 || (now - cpu->since) < config_starving_threshold)
-			continue;
+			log_verbose("\t cpu %d: pid: %d starving for %.3f\n",
+				    i, task->pid, ns_to_sec(now - task->since));
 
-		/* Log when task has reached starvation threshold */
-		if ((now - cpu->since) >= config_starving_threshold) {
-			log_msg("%s-%d starved on CPU %d for %d seconds\n",
-				cpu->task.comm, cpu->pid, i,
-				(now - cpu->since));
-		}
+			/* The tasks are sorted: the next ones starved for less. */
+			if ((now - task->since) < config_starving_threshold)
+				break;
 
-		if (config_log_only) {
-			/* Reset timestamp to avoid continuous logging */
-			cpu->since = now;
-			continue;
-		}
+			log_msg("%s-%d starved on CPU %d for %.3f seconds\n",
+				task->comm, task->pid, i,
+				ns_to_sec(now - task->since));
 
-		/* Skip if task is on denylist */
-		if (config_ignore && !check_task_ignore(&cpu->task))
-			continue;
+			if (config_log_only) {
+				/* Reset timestamp to avoid continuous logging */
+				task->since = now;
+				continue;
+			}
 
-		/* Save the task policy. */
-		ret = get_current_policy(cpu->pid, &attr[i]);
-		if (!ret) /* It is ok if a task die. */
-			/* Boost! */
-			ret = boost_with_deadline(cpu->tgid, cpu->pid, &cpus[i]);
+			/* Skip if task is on denylist */
+			if (config_ignore && !check_task_ignore(task))
+				continue;
 
-		if (ret < 0) {
-			cleanup_starving_task_info(cpu);
-			continue;
+			queue_starving_task(task, &cpus[i]);
+			starving++;
 		}
-
-		/* Save it for the deboost. */
-		deboost_vector[i] = cpu->pid;
-		boosted++;
 	}
 
-	if (!boosted)
+	if (!starving)
 		return 0;
 
-	sleep(config_boost_duration);
-
-	for (i = 0; i < nr_cpus; i++) {
-		if (deboost_vector[i] != 0)
-			restore_policy(deboost_vector[i], &attr[i]);
-	}
-
-	return boosted;
+	/* Boost! It is ok if a task die. */
+	return boost_starving_tasks();
 }
 
 void single_threaded_main(struct cpu_info *cpus, int nr_cpus)
 {
+	struct stalld_snapshot *snapshot;
 	char busy_cpu_list[nr_cpus];
-	size_t buffer_size = 0;
+	struct stalld_loop loop;
 	struct cpu_info *cpu;
-	char *buffer = NULL;
 	int overloaded = 0;
+	uint64_t now;
 	int boosted = 0;
 	int retval;
 	int i;
 
 	log_msg("single threaded mode\n");
 
-	if (!config_log_only && boost_policy != SCHED_DEADLINE)
-		die("Single threaded mode only works with SCHED_DEADLINE");
+	if (loop_init(&loop, 1) || loop_set_tick(&loop, config_granularity))
+		die("cannot set up the event loop");
 
-	cpu_starving_vector = allocate_memory(nr_cpus, sizeof(struct cpu_starving_task_info));
-	buffer = allocate_memory(config_buffer_size, sizeof *buffer);
+	boosts_loop = &loop;
+	init_scan_intervals();
 
-	buffer_size = config_buffer_size;
+	cpu_starving_vector = allocate_memory(nr_cpus, sizeof(struct cpu_starving_task_info));
 
-	for (i = 0; i < nr_cpus; i++) {
-		cpus[i].id = i;
+	for (i = 0; i < nr_cpus; i++)
 		cpus[i].thread_running = 0;
-		cpu_starving_vector[i].pid = 0;
-		cpu_starving_vector[i].since = 0;
-		cpu_starving_vector[i].overloaded = 0;
-		memset(&cpu_starving_vector[i].task, 0, sizeof(struct task_info));
-	}
 
 	while (running) {
 
-		/* Buffer size should increase. See sched_debug_get(). */
-		resize_buffer_if_needed(&buffer, &buffer_size);
-
-		if (should_skip_idle_cpus(cpus, nr_cpus, busy_cpu_list))
-			goto skipped;
+		now = get_time_ns();
+		snapshot = snapshot_new();
 
-		if (backend->get) {
-			retval = backend->get(buffer, buffer_size);
-			if (!retval) {
-				warn("Dazed and confused, but trying to continue");
-				continue;
-			}
+		/* A rescan only parses the overloaded CPUs, set below. */
+		if (overloaded) {
+			overloaded = 0;
+		} else {
+			should_skip_idle_cpus(cpus, nr_cpus, busy_cpu_list, snapshot);
+			if (!filter_due_cpus(cpus, nr_cpus, busy_cpu_list, now))
+				goto skipped;
 		}
 
-		for (i = 0; i < nr_cpus; i++) {
-			if (!should_monitor(i))
-				continue;
+		if (!snapshot_read_backend(snapshot)) {
+			warn("Dazed and confused, but trying to continue");
+			goto skipped;
+		}
 
+		for_each_cpu(i, &monitored_cpus) {
 			cpu = &cpus[i];
 
-			if (config_idle_detection && !busy_cpu_list[i])
+			if (!busy_cpu_list[i])
 				continue;
 
-			retval = get_cpu_and_parse(cpu, buffer, buffer_size);
+			retval = parse_snapshot(cpu, snapshot);
+			schedule_cpu_scan(cpu, now, retval);
 			if (retval)
 				continue;
 
@@ -1053,50 +2083,34 @@ void single_threaded_main(struct cpu_info *cpus, int nr_cpus)
 		}
 
 		boosted = boost_cpu_starving_vector(cpu_starving_vector, nr_cpus, cpus);
-		if (!boosted)
-			goto skipped;
 
 		/* Cleanup the CPU starving vector. */
-		for (i = 0; i < nr_cpus; i++) {
-			if (cleanup_starving_task_info(cpu_starving_vector+i))
+		for_each_cpu(i, &monitored_cpus) {
+			busy_cpu_list[i] = cleanup_starving_task_info(cpu_starving_vector+i);
+			if (busy_cpu_list[i] && boosted)
 				overloaded = 1;
 		}
 
 		/*
-		 * If any CPU had more than one thread starving, the system is overloaded.
-		 * Re-run the loop without sleeping for two reasons: to boost the other
-		 * thread, and to detect other starving threads on other CPUs, given
-		 * that the system seems to be overloaded.
+		 * If any CPU had more starving threads than it could boost in
+		 * a cycle, it is overloaded. Re-run the loop without sleeping
+		 * to boost the others, parsing only the overloaded CPUs.
 		 */
 		if (overloaded) {
-			overloaded = 0;
+			snapshot_put(snapshot);
 			continue;
 		}
 
 skipped:
-		/* If no boost was required, just sleep. */
-		if (!boosted) {
-			sleep(config_granularity);
-			continue;
-		}
-
-		/*
-		 * If the boost duration is longer than the granularity, there
-		 * is no need for a sleep.
-		 */
-		if (config_granularity <= config_boost_duration)
-			continue;
-
-		/*
-		 * Ok, sleep for the rest of the time.
-		 *
-		 * Yeah, but is it worth to get the time to compute the overhead?
-		 * at the end, it should be less than one second anyway.
-		 */
-		sleep(config_granularity - config_boost_duration);
+		snapshot_put(snapshot);
+		/* Wait for the next tick, deboosting the tasks meanwhile. */
+		wait_next_scan(&loop, cpus, nr_cpus, now);
 	}
-	if (buffer)
-		free(buffer);
+	run_boosts(1);
+	boost_heap_destroy(&boosts);
+	boost_heap_destroy(&starving_tasks);
+	snapshot_destroy();
+	loop_destroy(&loop);
 }
 
 int check_policies(void)
@@ -1120,10 +2134,10 @@ int check_policies(void)
 		die("unable to get scheduling policy!");
 
 	/* Try boosting to SCHED_DEADLINE. */
-	ret = boost_with_deadline(0, 0, NULL);
+	ret = boost_with_deadline("stalld", 0, NULL, config_dl_runtime);
 	if (ret < 0) {
 		/* Try boosting with FIFO to see if we have permission. */
-		ret = boost_with_fifo(0, 0, NULL);
+		ret = boost_with_fifo("stalld", 0, NULL);
 		if (ret < 0) {
 			log_msg("check_policies: unable to change policy to either deadline or fifo,"
 				"defaulting to logging only\n");
@@ -1160,12 +2174,17 @@ int main(int argc, char **argv)
 	if ((page_size = sysconf(_SC_PAGE_SIZE)) < 0)
 		die("Unable to get system page size: %s\n", strerror(errno));
 
-	config_nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	config_nr_cpus = get_nr_possible_cpus();
 	if (config_nr_cpus < 1)
 		die("Can not calculate number of CPUS\n");
 
 	parse_args(argc, argv);
 
+	if (config_housekeeping)
+		setup_housekeeping();
+
+	init_monitored_cpus();
+
 	/*
 	 * it will not die...
 	 */
@@ -1196,9 +2215,23 @@ int main(int argc, char **argv)
 	if (!config_log_only)
 		boost_policy = check_policies();
 
-	cpus = allocate_memory(config_nr_cpus, sizeof(struct cpu_info));
+	if (config_fair_server && !config_log_only && fair_server_init()) {
+		log_msg("cannot boost with the fair server, boosting each task\n");
+		config_fair_server = 0;
+	}
+
+	if (config_batch_boost && !config_log_only && boost_policy != SCHED_DEADLINE) {
+		log_msg("batch boosting needs SCHED_DEADLINE, boosting each task\n");
+		config_batch_boost = 0;
+	}
+
+	if (config_batch_boost)
+		batch_runtime = allocate_memory(config_nr_cpus, sizeof(*batch_runtime));
+
+	cpus = allocate_aligned_memory(config_nr_cpus, sizeof(struct cpu_info));
 
 	for (i = 0; i < config_nr_cpus; i++) {
+		cpus[i].id = i;
 		cpus[i].buffer = allocate_memory(1, config_buffer_size);
 		cpus[i].buffer_size = config_buffer_size;
 		cpus[i].idle_time = -1;  /* Initialize to -1 so first check doesn't skip busy CPUs */
@@ -1207,10 +2240,31 @@ int main(int argc, char **argv)
 	if (config_log_syslog)
 		openlog("stalld", 0, LOG_DAEMON);
 
+	/*
+	 * Without debugfs, e.g., in lockdown mode, sched_debug cannot
+	 * work: fall back to schedstat.
+	 */
+	if (backend == &sched_debug_backend && !find_sched_debug_path()) {
+		log_msg("sched_debug not available, falling back to the schedstat backend\n");
+		backend = &schedstat_backend;
+	}
+
+	/*
+	 * The run_delay filter only saves work for the sched_debug parser,
+	 * and only makes sense for the live system.
+	 */
+	if (config_run_delay_filter && backend != &sched_debug_backend) {
+		log_msg("the run_delay filter only works with the sched_debug backend, disabling it\n");
+		config_run_delay_filter = 0;
+	}
+
 	if (backend->init())
 		die("Cannot init backend");
 
-	setup_signal_handling();
+	if (setup_signal_handling())
+		die("cannot set up the signal handling");
+
+	setup_hotplug_events();
 
 	if (config_idle_detection)
 		STAT_MAX_SIZE = calc_stat_max(page_size);
@@ -1247,5 +2301,11 @@ int main(int argc, char **argv)
 
 	backend->destroy();
 
+	if (config_fair_server)
+		fair_server_destroy();
+
+	noise_budget_destroy();
+	free(batch_runtime);
+
 	exit(0);
 }
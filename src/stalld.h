@@ -11,6 +11,10 @@
 
 #include <regex.h>
 #include <sched.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cpumask.h"
 
 #define BUFFER_PAGES		10
 #define MAX_WAITING_PIDS	30
@@ -55,25 +59,64 @@ struct task_info {
        int tgid;
        int prio;
        int ctxsw;
-       time_t since;
+       uint64_t since;
+       uint64_t runtime;	/* sum_exec_runtime, 0 if not reported */
        char comm[COMM_SIZE];
 };
 
+#define CACHELINE_SIZE	64
+
 /*
  * Information about CPUs.
+ *
+ * Each CPU is monitored by one thread at a time, but the elements are
+ * in an array: they are cacheline aligned, with the fields the monitor
+ * writes at each parse on their own cache lines, away from the ones the
+ * other threads read.
  */
 struct cpu_info {
+       /* Read by all the threads. */
        int id;
-       int nr_running;
+       int thread_running;
+       uint64_t next_scan;		/* see schedule_cpu_scan() */
+
+       /* Written by the thread monitoring the CPU. */
+       int nr_running __attribute__((aligned(CACHELINE_SIZE)));
        int nr_rt_running;
        int ctxsw;
        int nr_waiting_tasks;
-       int thread_running;
        long idle_time;
+       uint64_t run_delay;
+       uint64_t ttwu_count;
+       uint64_t last_parse;
+       unsigned long snapshot_version;	/* the last snapshot parsed */
+       uint64_t scan_interval;
        struct task_info *starving;
-       pthread_t thread;
+       struct task_info *task_arrays[2];	/* starving is one of them */
+       int max_tasks[2];
        char *buffer;
        size_t buffer_size;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+/*
+ * Per-CPU counters from /proc/schedstat.
+ */
+struct cpu_schedstat {
+	int online;
+	uint64_t ttwu_count;
+	uint64_t run_delay;
+	uint64_t pcount;
+};
+
+/*
+ * The fields of /proc/<pid>/task/<tid>/stat used by stalld.
+ */
+struct proc_task_stat {
+	char comm[COMM_SIZE];
+	char state;
+	int prio;
+	int cpu;
+	int policy;
 };
 
 struct stalld_backend {
@@ -103,6 +146,21 @@ struct stalld_backend {
 	 */
 	int (*has_starving_task)(struct cpu_info *cpu);
 
+	/*
+	 * Optional, for event driven backends: the fds that become
+	 * readable when there are events to process, and the function
+	 * processing them from the event loop. It returns non-zero
+	 * to have the run-queues scanned right away.
+	 */
+	int (*event_fds)(int **fds);
+	int (*process_events)(void);
+
+	/*
+	 * Optional: start or stop monitoring a CPU that came online or
+	 * went offline.
+	 */
+	void (*set_cpu_monitoring)(int cpu, int monitor);
+
 	/*
 	 * destroy the backend.
 	 */
@@ -157,6 +215,8 @@ static inline int sched_getattr(pid_t pid, struct sched_attr *attr,
 #endif /* !__GLIBC_PREREQ(2, 41) */
 
 #define NS_PER_SEC 1000000000uL
+#define NS_PER_MS 1000000uL
+#define NS_PER_US 1000uL
 
 static inline void normalize_timespec(struct timespec *ts)
 {
@@ -166,6 +226,22 @@ static inline void normalize_timespec(struct timespec *ts)
         }
 }
 
+/*
+ * The control loop timestamps, in nanoseconds, immune to wall clock changes.
+ */
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static inline double ns_to_sec(uint64_t ns)
+{
+	return (double) ns / NS_PER_SEC;
+}
+
 /*
  * Forward function definitions.
  */
@@ -186,11 +262,13 @@ void log_msg(const char *fmt, ...);
 	} while (0)
 
 long get_long_from_str(char *start);
+uint64_t get_duration_from_str(char *start);
 long get_long_after_colon(char *start);
 long get_variable_long_value(char *buffer, const char *variable);
 int fill_process_comm(int tgid, int pid, char *comm, int comm_size);
 int resize_buffer_if_needed(char **buffer, size_t *current_size);
 void *allocate_memory(size_t count, size_t size);
+void *allocate_aligned_memory(size_t count, size_t size);
 
 int setup_signal_handling(void);
 void daemonize(void);
@@ -202,11 +280,16 @@ int parse_args(int argc, char **argv);
 int rt_throttling_is_off(void);
 int turn_off_rt_throttling(void);
 void cleanup_regex(unsigned int *nr_task, regex_t **compiled_expr);
-void find_sched_debug_path(void);
-int set_reservation(int period, int reservation);
+int find_sched_debug_path(void);
+int find_tracefs_path(char *path, size_t size);
+int set_reservation(uint64_t period, int reservation);
 int get_tgid(int pid);
 void merge_taks_info(int cpu, struct task_info *old_tasks, int nr_old, struct task_info *new_tasks, int nr_new);
+struct task_info *get_task_array(struct cpu_info *cpu, int nr_tasks);
+uint64_t get_scan_interval(struct cpu_info *cpu, uint64_t now, int quiet);
 int set_cpu_affinity(char *cpu_list);
+int setup_housekeeping(void);
+int get_dl_server_path(char *path, size_t size);
 int check_dl_server_dir_exists(void);
 
 /*
@@ -224,15 +307,26 @@ extern unsigned long config_dl_period;
 extern unsigned long config_dl_runtime;
 extern unsigned long config_fifo_priority;
 extern unsigned long config_force_fifo;
-extern long config_starving_threshold;
-extern long config_boost_duration;
+extern int config_max_boosts;
+extern int config_adaptive_boost;
+extern int config_fair_server;
+extern int config_early_deboost;
+extern uint64_t config_batch_boost;
+extern uint64_t config_noise_budget;
+extern uint64_t config_noise_window;
+extern uint64_t config_starving_threshold;
+extern uint64_t config_boost_duration;
 extern long config_aggressive;
 extern int config_monitor_all_cpus;
-extern char *config_monitored_cpus;
+extern struct cpumask config_monitored_cpus;
+extern struct cpumask monitored_cpus;
+extern struct cpumask online_cpus;
 extern int config_nr_cpus;
 extern int config_systemd;
-extern long config_granularity;
+extern uint64_t config_granularity;
 extern int config_idle_detection;
+extern int STAT_MAX_SIZE;
+extern int config_run_delay_filter;
 extern int config_single_threaded;
 extern int config_adaptive_multi_threaded;
 extern char pidfile[];
@@ -241,12 +335,21 @@ extern unsigned int nr_process_ignore;
 extern regex_t *compiled_regex_thread;
 extern regex_t *compiled_regex_process;
 extern char *config_sched_debug_path;
+extern char *config_replay_path;
+extern unsigned long config_run_delay_threshold;
 extern int config_reservation;
 extern size_t config_buffer_size;
 extern long page_size;
 extern struct stalld_backend *backend;
 extern char *config_affinity_cpus;
+extern int config_housekeeping;
 extern int read_proc_stat(char *buffer, int size);
+int read_proc_schedstat(char **buffer, size_t *size);
+int parse_proc_schedstat(char *buffer, struct cpu_schedstat *stats, int nr_cpus);
+int read_proc_task_file(int tgid, int tid, const char *file, char *buffer, int size);
+int open_task_pidfd(int tgid, int pid);
+int task_exited(int pidfd);
+int parse_proc_task_stat(char *buffer, struct proc_task_stat *stat);
 
 #define MAX_FILE_NAME	1024
 #define MAX_PATH	4096
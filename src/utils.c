@@ -28,10 +28,15 @@
 #include <sched.h>
 #include <linux/sched.h>
 #include <sys/sysinfo.h>
+#include <math.h>
 #include <mntent.h>
+#include <poll.h>
+#include <sys/syscall.h>
 
 #include "stalld.h"
 #include "sched_debug.h"
+#include "schedstat.h"
+#include "sched_events.h"
 #if USE_BPF
 #include "queue_track.h"
 #endif
@@ -71,6 +76,20 @@ void *allocate_memory(size_t count, size_t size)
 	return ptr;
 }
 
+/*
+ * Like allocate_memory(), cacheline aligned.
+ */
+void *allocate_aligned_memory(size_t count, size_t size)
+{
+	void *ptr;
+
+	if (posix_memalign(&ptr, CACHELINE_SIZE, count * size))
+		die("Cannot allocate memory");
+
+	memset(ptr, 0, count * size);
+	return ptr;
+}
+
 /*
  * fill_process_comm - process name from task group ID.
  */
@@ -133,6 +152,49 @@ long get_long_from_str(char *start)
 	return value;
 }
 
+/*
+ * Parse a duration such as "200ms", "1.5s" or "500us" into nanoseconds. A
+ * number without a unit is in seconds, as with the older versions.
+ *
+ * Returns 0 with errno set if the duration is not valid.
+ */
+uint64_t get_duration_from_str(char *start)
+{
+	uint64_t unit;
+	double value;
+	char *end;
+
+	errno = 0;
+	value = strtod(start, &end);
+	if (errno || start == end || !isfinite(value) || value < 0) {
+		warn("Invalid duration '%s'", start);
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (*end == '\0' || !strcmp(end, "s"))
+		unit = NS_PER_SEC;
+	else if (!strcmp(end, "ms"))
+		unit = NS_PER_MS;
+	else if (!strcmp(end, "us"))
+		unit = NS_PER_US;
+	else if (!strcmp(end, "ns"))
+		unit = 1;
+	else {
+		warn("Invalid duration unit '%s'", end);
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (value >= (double) (UINT64_MAX / unit)) {
+		warn("Duration '%s' is too long", start);
+		errno = EINVAL;
+		return 0;
+	}
+
+	return value * unit;
+}
+
 long get_long_after_colon(char *start)
 {
 	/* Find the ":". */
@@ -163,89 +225,6 @@ long get_variable_long_value(char *buffer, const char *variable)
 	return get_long_after_colon(start);
 }
 
-/*
- * SIGINT handler for main.
- */
-static void inthandler(int signo, siginfo_t *info, void *extra)
-{
-	log_msg("received signal %d, starting shutdown\n", signo);
-	running = 0;
-}
-
-static void set_sig_handler(void)
-{
-	struct sigaction action;
-
-	memset(&action, 0, sizeof(action));
-
-	action.sa_flags = SA_SIGINFO;
-	action.sa_sigaction = inthandler;
-	sigemptyset(&action.sa_mask);
-
-	if (sigaction(SIGINT, &action, NULL) == -1) {
-		warn("error setting SIGINT handler: %s\n",
-		      strerror(errno));
-		exit(errno);
-	}
-
-	action.sa_flags = SA_SIGINFO;
-	action.sa_sigaction = inthandler;
-
-	if (sigaction(SIGTERM, &action, NULL) == -1) {
-		warn("error setting SIGTERM handler: %s\n",
-		      strerror(errno));
-		exit(errno);
-	}
-}
-
-int setup_signal_handling(void)
-{
-	sigset_t sigset;
-	int status;
-
-	/* Mask off all signals. */
-	status = sigfillset(&sigset);
-	if (status) {
-		warn("setting up full signal set %s\n", strerror(errno));
-		return status;
-	}
-
-	status = pthread_sigmask(SIG_BLOCK, &sigset, NULL);
-	if (status) {
-		warn("setting signal mask: %s\n", strerror(status));
-		return status;
-	}
-
-	/* Now allow SIGINT and SIGTERM to be delivered. */
-	status = sigemptyset(&sigset);
-	if (status) {
-		warn("creating empty signal set: %s\n", strerror(errno));
-		return status;
-	}
-
-	status = sigaddset(&sigset, SIGINT);
-	if (status) {
-		warn("adding SIGINT to signal set: %s\n", strerror(errno));
-		return status;
-	}
-
-	status = sigaddset(&sigset, SIGTERM);
-	if (status) {
-		warn("adding SIGTERM to signal set: %s\n", strerror(errno));
-		return status;
-	}
-
-	status = pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
-	if (status) {
-		warn("unblocking signals: %s\n", strerror(status));
-		return status;
-	}
-
-	/* Now register our signal handler. */
-	set_sig_handler();
-	return 0;
-}
-
 /*
  * Print any error messages and exit.
  */
@@ -508,21 +487,17 @@ static int find_proc_sched_debug(void)
 /*
  * Look for the sched debug file on the possible locations.
  *
- * stalld depends on sched_debug file, if it is not found: die.
+ * Returns 1 if found, 0 otherwise.
  */
-void find_sched_debug_path(void)
+int find_sched_debug_path(void)
 {
 	int found;
 
 	found = find_debugfs_sched_debug();
 	if (found)
-		return;
-
-	found = find_proc_sched_debug();
-	if (found)
-		return;
+		return 1;
 
-	die("stalld could not find the sched_debug file.\n");
+	return find_proc_sched_debug();
 }
 
 /*
@@ -665,12 +640,7 @@ int setup_hr_tick(void)
 
 int should_monitor(int cpu)
 {
-	if (config_monitor_all_cpus)
-		return 1;
-	if (config_monitored_cpus[cpu])
-		return 1;
-
-	return 0;
+	return cpumask_test_cpu(cpu, &monitored_cpus);
 }
 
 /*
@@ -696,13 +666,13 @@ void write_pidfile(void)
  *
  * Set stalld to run with reservation % of CPU time using SCHED_DEADLINE.
  *
- * If the period is < 4 s (see kernel.sched_deadline_period_max_us), stalld
+ * The period is in ns. If it is < 4 s (see kernel.sched_deadline_period_max_us), stalld
  * will have the dl_period set as period. If it is higher than 4s, the
  * reservation will be configure as 1s period. This does not change the
  * picture, as at the end, the task will receive the % of time, while
  * avoiding have yet another knob to handle.
  */
-int set_reservation(int period, int reservation)
+int set_reservation(uint64_t period, int reservation)
 {
 	unsigned long dl_period, dl_runtime;
 	struct sched_attr attr;
@@ -712,10 +682,10 @@ int set_reservation(int period, int reservation)
 	if (reservation == 0)
 		return 0;
 
-	if (period > 4)
-		period = 1;
+	if (period > 4 * NS_PER_SEC)
+		period = NS_PER_SEC;
 
-	dl_period = period * 1000 * 1000 * 1000;
+	dl_period = period;
 	dl_runtime = dl_period * reservation / 100;
 
 	memset(&attr, 0, sizeof(attr));
@@ -745,7 +715,7 @@ static void print_usage(void)
 		"  usage: stalld [-l] [-v] [-k] [-s] [-f] [-h] \\",
 		"          [-c cpu-list] \\",
 		"          [-p time in ns] [-r time in ns] \\",
-		"          [-d time in seconds] [-t time in seconds] \\",
+		"          [-d duration] [-t duration] [-g duration] \\",
 		"          [-R percentage ] [-a cpu-list]",
 		"",
 		"       logging options:",
@@ -757,20 +727,40 @@ static void print_usage(void)
 		"        boosting options:",
 		"          -p/--boost_period: SCHED_DEADLINE period [ns] that the starving task will receive",
 		"          -r/--boost_runtime: SCHED_DEADLINE runtime [ns] that the starving task will receive",
-		"          -d/--boost_duration: how long [s] the starving task will run with SCHED_DEADLINE",
+		"          -d/--boost_duration: how long [s, ms, us or ns] the starving task will run with SCHED_DEADLINE",
+		"                               (durations accept a s, ms, us or ns suffix, e.g., 200ms)",
 		"          -F/--force_fifo: use SCHED_FIFO for boosting",
+		"          --max_boosts: maximum number of tasks boosted at once, the ones starving for",
+		"                        the longest first (0 for no limit)",
+		"          --adaptive_boost: size the runtime and duration of the boosts per class of tasks,",
+		"                            after the progress of the tasks boosted, from 1/16 to 16 times",
+		"                            -r and -d",
+		"          --fair_server: boost the starving fair tasks by raising the runtime of the",
+		"                         DL-server of their CPU, for all of them at once",
+		"          --early_deboost: restore the boosted task as soon as it goes to sleep, checking",
+		"                           it at each boost period",
+		"          --batch_boost: boost the starving tasks of a CPU at once, sharing this",
+		"                         SCHED_DEADLINE runtime [ns] per period, and restore them together",
+		"          --noise_budget: maximum boost runtime [s, ms, us or ns] injected on a CPU per noise window,",
+		"                          the boosts past it are deferred (0 for no limit)",
+		"          --noise_window: the sliding window of the noise budget [s, ms, us or ns]",
 		"        monitoring options:",
-		"          -t/--starving_threshold: how long [s] the starving task will wait before being boosted",
-		"          -A/--aggressive_mode: dispatch one thread per run queue, even when there is no starving",
+		"          -t/--starving_threshold: how long [s, ms, us or ns] the starving task will wait before being boosted",
+		"          -A/--aggressive_mode: monitor each run queue on its own, even when there is no starving",
 		"                               threads on all CPU (uses more CPU/power).",
 		"          -M/--adaptive_mode: when a CPU shows threads starving for more than half of the",
-		"                               starving_threshold time, dispatch a specialized thread to monitor",
-		"                               it.",
+		"                               starving_threshold time, monitor it on its own.",
+		"                               (the run queues are monitored by one worker per stalld CPU)",
 		"	   -O/--power_mode: works as a single threaded tool. Saves CPU, but loses precision.",
 		"	   -N/--no_idle_detect: disable idle CPU detection optimization (for testing)",
-		"	   -g/--granularity: set the granularity at which stalld checks for starving threads",
+		"	   --run_delay_filter: only parse the busy CPUs whose run_delay in /proc/schedstat grew",
+		"	                       (sched_debug backend, power and adaptive modes)",
+		"	   -g/--granularity: set the granularity [s, ms, us or ns] at which stalld checks for",
+		"	                     starving threads",
 		"	   -R/--reservation: percentage of CPU time reserved to stalld using SCHED_DEADLINE.",
 		"	   -a/--affinity: limit stalld's affinity",
+		"	   -H/--housekeeping: run on the housekeeping cpus and monitor the isolated ones",
+		"	                      (isolcpus, nohz_full and isolated cpuset partitions)",
 		"        ignoring options:",
 		"          -i/--ignore_threads: regexes (comma-separated) of thread names that must be ignored",
 		"                               from being boosted",
@@ -782,6 +772,12 @@ static void print_usage(void)
 #if USE_BPF
 		"		queue_track || Q: for tracking enqueue/dequeue of tasks in the runqueues.",
 #endif
+		"		ftrace_track || F: for tracking the runqueues with sched events from tracefs (no BPF).",
+		"		perf_track || P: for tracking the runqueues with sched events from perf (no BPF, no debugfs).",
+		"		schedstat || T: for /proc/schedstat run_delay and per-task schedstat (no debugfs).",
+		"		replay:<path> || R:<path>: replay sched/debug snapshots from a file or directory.",
+		"	   --run_delay_threshold: run_delay growth [ns] for a CPU to be scanned by the schedstat backend",
+		"	                          or the run_delay filter",
 		"	misc:",
 		"          --pidfile: write daemon pid to specified file",
 		"          -S/--systemd: running as systemd service, don't fiddle with RT throttling",
@@ -937,11 +933,7 @@ static void parse_cpu_list(char *cpulist)
 	int cpu;
 	int i;
 
-	config_monitored_cpus = malloc(config_nr_cpus * sizeof(char));
-	if (!config_monitored_cpus)
-		goto err;
-
-	memset(config_monitored_cpus, 0, (config_nr_cpus * sizeof(char)));
+	cpumask_init(&config_monitored_cpus, config_nr_cpus);
 
 	for (p = cpulist; *p; ) {
 		cpu = atoi(p);
@@ -962,11 +954,11 @@ static void parse_cpu_list(char *cpulist)
 
 		if (cpu == end_cpu) {
 			info("cpulist: adding cpu %d\n", cpu);
-			config_monitored_cpus[cpu] = 1;
+			cpumask_set_cpu(cpu, &config_monitored_cpus);
 		} else {
 			for (i = cpu; i <= end_cpu; i++) {
 				info("cpulist: adding cpu %d\n", i);
-				config_monitored_cpus[i] = 1;
+				cpumask_set_cpu(i, &config_monitored_cpus);
 			}
 		}
 
@@ -1013,13 +1005,23 @@ int parse_args(int argc, char **argv)
 			{"ignore_processes",    required_argument, 0, 'I'},
 			{"backend",		required_argument, 0, 'b'},
 			{"affinity",		required_argument, 0, 'a'},
+			{"housekeeping",	no_argument,	   0, 'H'},
+			{"run_delay_threshold",	required_argument, 0, 'T'},
+			{"run_delay_filter",	no_argument,	   0, 'D'},
+			{"max_boosts",		required_argument, 0, 'B'},
+			{"adaptive_boost",	no_argument,	   0, 'Z'},
+			{"fair_server",		no_argument,	   0, 'Y'},
+			{"early_deboost",	no_argument,	   0, 'E'},
+			{"batch_boost",		required_argument, 0, 'Q'},
+			{"noise_budget",	required_argument, 0, 'W'},
+			{"noise_window",	required_argument, 0, 'X'},
 			{0, 0, 0, 0}
 		};
 
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "lvkfAOMNhsp:r:d:t:c:FVSg:i:I:R:b:a:",
+		c = getopt_long(argc, argv, "lvkfAOMNhsp:r:d:t:c:FVSg:i:I:R:b:a:H",
 				 long_options, &option_index);
 
 		/* Detect the end of the options. */
@@ -1079,20 +1081,20 @@ int parse_args(int argc, char **argv)
 				usage("boost_runtime should be at most 1 ms");
 			break;
 		case 'd':
-			config_boost_duration = get_long_from_str(optarg);
+			config_boost_duration = get_duration_from_str(optarg);
 			if (config_boost_duration < 1)
-				usage("boost_duration should be at least 1 second");
+				usage("boost_duration should be at least 1 ns");
 
-			if (config_boost_duration > 60)
+			if (config_boost_duration > 60 * NS_PER_SEC)
 				usage("boost_duration should be at most 60 seconds");
 
 			break;
 		case 't':
-			config_starving_threshold = get_long_from_str(optarg);
+			config_starving_threshold = get_duration_from_str(optarg);
 			if (config_starving_threshold < 1)
-				usage("starving_threshold should be at least 1 second");
+				usage("starving_threshold should be at least 1 ns");
 
-			if (config_starving_threshold > 3600)
+			if (config_starving_threshold > 3600 * NS_PER_SEC)
 				usage("boost_duration should be at most one hour");
 
 			break;
@@ -1106,6 +1108,34 @@ int parse_args(int argc, char **argv)
 		case 'F':
 			config_force_fifo = 1;
 			break;
+		case 'B':
+			config_max_boosts = get_long_from_str(optarg);
+			if (config_max_boosts < 0)
+				usage("max_boosts cannot be negative");
+			break;
+		case 'Z':
+			config_adaptive_boost = 1;
+			break;
+		case 'Y':
+			config_fair_server = 1;
+			break;
+		case 'E':
+			config_early_deboost = 1;
+			break;
+		case 'Q':
+			config_batch_boost = get_long_from_str(optarg);
+			break;
+		case 'W':
+			/* 0 is no limit, not a typo. */
+			config_noise_budget = get_duration_from_str(optarg);
+			if (errno)
+				usage("invalid noise_budget");
+			break;
+		case 'X':
+			config_noise_window = get_duration_from_str(optarg);
+			if (config_noise_window < 1)
+				usage("noise_window should be at least 1 ns");
+			break;
 		case 'V':
 			puts(version);
 			exit(0);
@@ -1114,11 +1144,11 @@ int parse_args(int argc, char **argv)
 			config_systemd = 1;
 			break;
 		case 'g':
-			config_granularity = get_long_from_str(optarg);
-			if (config_granularity < 1)
-				usage("granularity should be at least 1 second");
+			config_granularity = get_duration_from_str(optarg);
+			if (config_granularity < NS_PER_MS)
+				usage("granularity should be at least 1 ms");
 
-			if (config_granularity > 600)
+			if (config_granularity > 600 * NS_PER_SEC)
 				usage("granularity should not be more than 10 minutes");
 
 			break;
@@ -1158,6 +1188,19 @@ int parse_args(int argc, char **argv)
 				backend = &queue_track_backend;
 				log_msg("using queue_track backend\n");
 #endif
+			} else if (!strcmp(optarg, "ftrace_track") || !strcmp(optarg, "F")) {
+				backend = &ftrace_track_backend;
+				log_msg("using ftrace_track backend\n");
+			} else if (!strcmp(optarg, "perf_track") || !strcmp(optarg, "P")) {
+				backend = &perf_track_backend;
+				log_msg("using perf_track backend\n");
+			} else if (!strcmp(optarg, "schedstat") || !strcmp(optarg, "T")) {
+				backend = &schedstat_backend;
+				log_msg("using schedstat backend\n");
+			} else if (!strncmp(optarg, "replay:", 7) || !strncmp(optarg, "R:", 2)) {
+				backend = &replay_backend;
+				config_replay_path = strchr(optarg, ':') + 1;
+				log_msg("using replay backend\n");
 			} else {
 				usage("unknown backend %s\n", optarg);
 			}
@@ -1165,6 +1208,18 @@ int parse_args(int argc, char **argv)
 		case 'a':
 			config_affinity_cpus = optarg;
 			break;
+		case 'H':
+			config_housekeeping = 1;
+			break;
+		case 'T':
+			config_run_delay_threshold = get_long_from_str(optarg);
+			if ((long) config_run_delay_threshold < 0)
+				usage("run_delay_threshold cannot be negative");
+			break;
+		case 'D':
+			config_run_delay_filter = 1;
+			log_msg("run_delay filter enabled\n");
+			break;
 		case '?':
 			usage("Invalid option");
 			break;
@@ -1176,19 +1231,20 @@ int parse_args(int argc, char **argv)
 	if (config_dl_period < config_dl_runtime)
 		usage("runtime is longer than the period");
 
-	if (config_dl_period > (config_boost_duration * NS_PER_SEC))
+	if (config_dl_period > config_boost_duration)
 		usage("the period is longer than the boost_duration: the boosted task might not be able to run");
 
 	if (config_boost_duration > config_starving_threshold)
 		usage("the boost duration cannot be longer than the starving threshold ");
 
-	if (config_force_fifo && config_single_threaded) {
-		log_msg("-F/--force_fifo does not work in single-threaded mode\n");
-		log_msg("falling back to the adaptive mode\n");
-		config_adaptive_multi_threaded = 1;
-		config_single_threaded = 0;
-		config_aggressive = 0;
-	}
+	if (config_batch_boost && config_batch_boost < config_dl_runtime)
+		usage("the batch runtime is smaller than the runtime of a boost");
+
+	if (config_batch_boost > config_dl_period)
+		usage("the batch runtime is longer than the boost period");
+
+	if (config_noise_budget && config_noise_budget < config_dl_runtime)
+		usage("the noise budget is smaller than the runtime of a boost");
 
 	if (config_reservation && (config_aggressive || config_adaptive_multi_threaded))
 		usage("-R/--reservation only works in the single-threaded mode");
@@ -1261,6 +1317,74 @@ static int find_debugfs_mount_point(char *mount_path_buf, size_t buf_size) {
 	return ret;
 }
 
+/*
+ * Look for the tracefs: its own mount point, or the tracing directory
+ * in the debugfs on older systems.
+ *
+ * Returns 1 if found, 0 otherwise.
+ */
+int find_tracefs_path(char *path, size_t size)
+{
+	char debugfs[MAX_DIR_PATH] = "";
+	struct mntent *mnt;
+	struct stat st;
+	int found = 0;
+	FILE *fp;
+
+	fp = setmntent("/proc/mounts", "r");
+	if (!fp) {
+		warn("Error opening /proc/mounts");
+		return 0;
+	}
+
+	while ((mnt = getmntent(fp))) {
+		if (strcmp(mnt->mnt_type, "tracefs"))
+			continue;
+
+		if (strlen(mnt->mnt_dir) < size) {
+			snprintf(path, size, "%s", mnt->mnt_dir);
+			found = 1;
+		}
+		break;
+	}
+
+	endmntent(fp);
+
+	if (found)
+		return 1;
+
+	if (find_debugfs_mount_point(debugfs, sizeof(debugfs)) || !debugfs[0])
+		return 0;
+
+	if (snprintf(path, size, "%s/tracing", debugfs) >= size)
+		return 0;
+
+	return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Builds the path of the 'sched/fair_server' directory of debugfs in path.
+ *
+ * @return 0 on success, -1 if debugfs is not mounted or the path is too long.
+ */
+int get_dl_server_path(char *path, size_t size)
+{
+	char debugfs_mount_path[MAX_DIR_PATH];
+
+	if (find_debugfs_mount_point(debugfs_mount_path, sizeof(debugfs_mount_path))) {
+		warn("Debugfs mount point not found or error during lookup.\n");
+		return -1;
+	}
+
+	if (snprintf(path, size, "%s/sched/fair_server", debugfs_mount_path) >= size) {
+		errno = ENAMETOOLONG;
+		warn("Constructed path too long for buffer");
+		return -1;
+	}
+
+	return 0;
+}
+
 /**
  * Checks if the 'sched/fair_server' directory exists within debugfs,
  * dynamically determining the debugfs mount path.
@@ -1275,22 +1399,11 @@ static int find_debugfs_mount_point(char *mount_path_buf, size_t buf_size) {
  * Returns -1 if debugfs is not mounted, or other system error occurs.
  */
 int check_dl_server_dir_exists(void) {
-	char debugfs_mount_path[MAX_DIR_PATH];
 	char full_target_path[MAX_PATH];
 	struct stat st;
-	const char *dl_server_subdir = "/sched/fair_server";
-
-	if (find_debugfs_mount_point(debugfs_mount_path, sizeof(debugfs_mount_path))) {
-		warn("Debugfs mount point not found or error during lookup.\n");
-		return -1;
-	}
 
-	if (snprintf(full_target_path, sizeof(full_target_path), "%s%s",debugfs_mount_path,
-		     dl_server_subdir) >= sizeof(full_target_path)) {
-		errno = ENAMETOOLONG;
-		warn("Constructed path too long for buffer");
+	if (get_dl_server_path(full_target_path, sizeof(full_target_path)))
 		return -1;
-	}
 
 	if (stat(full_target_path, &st) == 0) {
 		if (S_ISDIR(st.st_mode))
@@ -1392,3 +1505,212 @@ out_close_fd:
 out_error:
 	return 0;
 }
+
+/*
+ * Read the content of /proc/schedstat into *buffer, growing it as
+ * needed: the domain lines make it large on big machines.
+ *
+ * Returns the number of bytes read, 0 on error.
+ */
+int read_proc_schedstat(char **buffer, size_t *size)
+{
+	size_t position = 0;
+	char *new_buffer;
+	int retval;
+	int fd;
+
+	fd = open("/proc/schedstat", O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	do {
+		if (position + 1 >= *size) {
+			new_buffer = realloc(*buffer, *size ? *size * 2 : page_size);
+			if (!new_buffer)
+				goto out_close_fd;
+			*buffer = new_buffer;
+			*size = *size ? *size * 2 : page_size;
+		}
+
+		retval = read(fd, *buffer + position, *size - position - 1);
+		if (retval < 0)
+			goto out_close_fd;
+
+		position += retval;
+	} while (retval > 0);
+
+	(*buffer)[position] = '\0';
+
+	close(fd);
+	return position;
+
+out_close_fd:
+	close(fd);
+	return 0;
+}
+
+/*
+ * Parse the per-CPU lines of /proc/schedstat (version 15 and later) into
+ * stats, indexed by CPU. CPUs missing from the file (offline) are zeroed.
+ *
+ * Format:
+ * "cpu1 0 0 4180232 2114731 2027547 1027364 832882911510 38318837510 2065491"
+ * "cpu  yld_count legacy sched_count sched_goidle ttwu_count ttwu_local
+ *  rq_cpu_time run_delay pcount"
+ *
+ * Returns the number of CPUs found.
+ */
+int parse_proc_schedstat(char *buffer, struct cpu_schedstat *stats, int nr_cpus)
+{
+	unsigned long long ttwu_count, run_delay, pcount;
+	char *line = buffer;
+	int found = 0;
+	int cpu;
+
+	memset(stats, 0, nr_cpus * sizeof(*stats));
+
+	while (line && *line) {
+		if (!strncmp(line, "cpu", 3) &&
+		    sscanf(line, "cpu%d %*u %*u %*u %*u %llu %*u %*u %llu %llu",
+			   &cpu, &ttwu_count, &run_delay, &pcount) == 4 &&
+		    cpu >= 0 && cpu < nr_cpus) {
+			stats[cpu].online = 1;
+			stats[cpu].ttwu_count = ttwu_count;
+			stats[cpu].run_delay = run_delay;
+			stats[cpu].pcount = pcount;
+			found++;
+		}
+
+		line = strchr(line, '\n');
+		if (line)
+			line++;
+	}
+
+	return found;
+}
+
+/*
+ * Read /proc/<tgid>/task/<tid>/<file> into buffer, as a string.
+ *
+ * Returns the number of bytes read, or -1 if the task is gone.
+ */
+int read_proc_task_file(int tgid, int tid, const char *file, char *buffer, int size)
+{
+	char path[PROC_PID_FILE_PATH_LEN * 2];
+	int retval;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/%s", tgid, tid, file);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	retval = read(fd, buffer, size - 1);
+	close(fd);
+
+	if (retval <= 0)
+		return -1;
+
+	buffer[retval] = '\0';
+	return retval;
+}
+
+/* pidfd_open has the same number on all the architectures. */
+#ifndef __NR_pidfd_open
+# define __NR_pidfd_open 434
+#endif
+
+#ifndef PIDFD_THREAD
+# define PIDFD_THREAD O_EXCL
+#endif
+
+/*
+ * Open a pidfd for the task: the handle of the task itself, that its pid
+ * cannot be reused under. A thread that does not lead its group needs
+ * PIDFD_THREAD, Linux 6.9.
+ *
+ * Returns the pidfd, or -1 with errno set: ESRCH if the task is gone.
+ */
+int open_task_pidfd(int tgid, int pid)
+{
+	unsigned int flags = 0;
+
+	if (tgid > 0 && tgid != pid)
+		flags = PIDFD_THREAD;
+
+	return syscall(__NR_pidfd_open, pid, flags);
+}
+
+/*
+ * Did the task of the pidfd exit? A pidfd is readable once it did, and
+ * its pid can be another task's. Without a pidfd, the task is taken as
+ * alive.
+ */
+int task_exited(int pidfd)
+{
+	struct pollfd pfd = {
+		.fd = pidfd,
+		.events = POLLIN,
+	};
+
+	if (pidfd < 0)
+		return 0;
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Parse /proc/<pid>/task/<tid>/stat: "tid (comm) state ...".
+ *
+ * The comm can contain spaces and parentheses, so the fields are counted
+ * from the last ')'. See proc_pid_stat(5) for the field numbers.
+ */
+int parse_proc_task_stat(char *buffer, struct proc_task_stat *stat)
+{
+	char *start, *end, *ptr;
+	int comm_size;
+	int field;
+
+	memset(stat, 0, sizeof(*stat));
+
+	start = strchr(buffer, '(');
+	end = strrchr(buffer, ')');
+	if (!start || !end || end < start)
+		return -EINVAL;
+
+	comm_size = end - start - 1;
+	if (comm_size >= COMM_SIZE)
+		comm_size = COMM_SIZE - 1;
+	strncpy(stat->comm, start + 1, comm_size);
+	stat->comm[comm_size] = '\0';
+
+	ptr = end + 1;
+	for (field = 3; field <= 41; field++) {
+		while (*ptr == ' ')
+			ptr++;
+		if (!*ptr)
+			return -EINVAL;
+
+		switch (field) {
+		case 3:
+			stat->state = *ptr;
+			break;
+		case 18:
+			/* Same scale as the sched_debug prio: 0-99 RT, 100-139 fair. */
+			stat->prio = strtol(ptr, NULL, 10) + 100;
+			break;
+		case 39:
+			stat->cpu = strtol(ptr, NULL, 10);
+			break;
+		case 41:
+			stat->policy = strtol(ptr, NULL, 10);
+			break;
+		}
+
+		while (*ptr && *ptr != ' ')
+			ptr++;
+	}
+
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * The pool of workers running the per-CPU monitors of the aggressive and
+ * adaptive modes.
+ *
+ * The pool has as many workers as stalld has CPUs to run on, that is,
+ * the housekeeping CPUs, whatever the number of monitored CPUs. Each
+ * worker runs on its own housekeeping CPU, and each monitored CPU is a job
+ * owned by a worker of its NUMA node, if any, so the per-CPU data the
+ * worker allocates and writes stays on the node. At each tick, the workers
+ * run the active jobs: their own first, then the ones still pending in the
+ * queues of the other workers, so a worker stuck on a slow job does not
+ * delay all the CPUs it owns.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "workers.h"
+
+/*
+ * Out of the aggressive mode, a CPU is not monitored anymore after this
+ * many cycles in a row with nothing to do.
+ */
+#define MAX_IDLE_CYCLES		10
+
+struct pool_job {
+	struct cpu_info *cpu;
+	unsigned long epoch;	/* the last tick it ran at */
+	int idle;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int cpu;		/* the housekeeping CPU it runs on */
+	int node;
+	int nr_jobs;
+	struct pool_job **jobs;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long pool_epoch;
+
+static struct worker *workers;
+static int nr_workers;
+static struct pool_job *jobs;
+static monitor_fn run_monitor;
+static int persistent_jobs;
+
+/*
+ * A job runs once per tick: the first worker to move its epoch runs it.
+ */
+static int claim_job(struct pool_job *job, unsigned long epoch)
+{
+	unsigned long last;
+
+	/* The CPU thread_running flag tells if the CPU is being monitored. */
+	if (!job->cpu->thread_running)
+		return 0;
+
+	last = __atomic_load_n(&job->epoch, __ATOMIC_ACQUIRE);
+	if (last >= epoch)
+		return 0;
+
+	return __atomic_compare_exchange_n(&job->epoch, &last, epoch, 0,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void run_job(struct pool_job *job)
+{
+	int retval;
+
+	retval = run_monitor(job->cpu);
+	if (retval > 0)
+		job->idle = 0;
+	else if (!retval)
+		job->idle++;
+
+	if (!persistent_jobs && job->idle >= MAX_IDLE_CYCLES) {
+		log_verbose("cpu %d had nothing to do, stop monitoring it\n", job->cpu->id);
+		job->idle = 0;
+		job->cpu->thread_running = 0;
+	}
+}
+
+/*
+ * Run the worker's jobs, then steal the pending ones of the other
+ * workers, from the end of their queue, away from their owner.
+ */
+static void run_jobs(struct worker *worker, unsigned long epoch)
+{
+	struct worker *victim;
+	int i, j;
+
+	for (j = 0; j < worker->nr_jobs && running; j++)
+		if (claim_job(worker->jobs[j], epoch))
+			run_job(worker->jobs[j]);
+
+	for (i = 1; i < nr_workers && running; i++) {
+		victim = &workers[(worker->id + i) % nr_workers];
+		for (j = victim->nr_jobs - 1; j >= 0 && running; j--)
+			if (claim_job(victim->jobs[j], epoch))
+				run_job(victim->jobs[j]);
+	}
+}
+
+static void *worker_main(void *data)
+{
+	struct worker *worker = data;
+	unsigned long epoch = 0;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(worker->cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		warn("cannot run worker %d on cpu %d\n", worker->id, worker->cpu);
+
+	pthread_mutex_lock(&pool_lock);
+
+	while (running) {
+		if (epoch == pool_epoch) {
+			pthread_cond_wait(&pool_cond, &pool_lock);
+			continue;
+		}
+
+		epoch = pool_epoch;
+		pthread_mutex_unlock(&pool_lock);
+
+		run_jobs(worker, epoch);
+
+		pthread_mutex_lock(&pool_lock);
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	return NULL;
+}
+
+/*
+ * The housekeeping CPUs: the ones stalld can run on. Returns their number.
+ */
+static int get_housekeeping_cpus(cpu_set_t *set)
+{
+	if (sched_getaffinity(0, sizeof(*set), set)) {
+		warn("cannot get the stalld affinity: %s\n", strerror(errno));
+		CPU_ZERO(set);
+		CPU_SET(0, set);
+	}
+
+	return CPU_COUNT(set);
+}
+
+/*
+ * The NUMA node of a CPU, from its nodeN link in sysfs. 0 if unknown.
+ */
+static int get_cpu_node(int cpu)
+{
+	struct dirent *entry;
+	char path[64];
+	int node = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	}
+
+	closedir(dir);
+
+	return node;
+}
+
+/*
+ * The worker for the job of a CPU: the one with the fewest jobs on the
+ * node of the CPU, or on any node if the node has no worker.
+ */
+static struct worker *pick_worker(int cpu)
+{
+	struct worker *best = NULL;
+	int node = get_cpu_node(cpu);
+	int local = 0;
+	int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		if (workers[i].node == node && !local) {
+			local = 1;
+			best = NULL;
+		}
+
+		if (local && workers[i].node != node)
+			continue;
+
+		if (!best || workers[i].nr_jobs < best->nr_jobs)
+			best = &workers[i];
+	}
+
+	return best;
+}
+
+/*
+ * Start the workers, with a job for each CPU to monitor, online or not.
+ * The CPUs with thread_running set are monitored at each tick. With persistent, they
+ * stay monitored, otherwise they stop after MAX_IDLE_CYCLES idle cycles.
+ */
+void worker_pool_start(struct cpu_info *cpus, int nr_cpus, monitor_fn monitor, int persistent)
+{
+	struct worker **owners;
+	struct worker *worker;
+	cpu_set_t set;
+	int nr_jobs;
+	int cpu = 0;
+	int i;
+
+	nr_jobs = cpumask_weight(&config_monitored_cpus);
+
+	nr_workers = get_housekeeping_cpus(&set);
+	if (nr_workers > nr_jobs)
+		nr_workers = nr_jobs;
+	if (nr_workers < 1)
+		nr_workers = 1;
+
+	run_monitor = monitor;
+	persistent_jobs = persistent;
+
+	jobs = allocate_memory(nr_jobs ? nr_jobs : 1, sizeof(*jobs));
+	owners = allocate_memory(nr_jobs ? nr_jobs : 1, sizeof(*owners));
+	workers = allocate_memory(nr_workers, sizeof(*workers));
+
+	for (i = 0; i < nr_workers; i++) {
+		while (!CPU_ISSET(cpu, &set))
+			cpu++;
+
+		workers[i].id = i;
+		workers[i].cpu = cpu;
+		workers[i].node = get_cpu_node(cpu);
+		cpu++;
+	}
+
+	/* Spread the jobs first, the queues are sized after. */
+	nr_jobs = 0;
+	for_each_cpu(i, &config_monitored_cpus) {
+		jobs[nr_jobs].cpu = &cpus[i];
+		owners[nr_jobs] = pick_worker(i);
+		owners[nr_jobs]->nr_jobs++;
+		nr_jobs++;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		workers[i].jobs = allocate_memory(workers[i].nr_jobs ? workers[i].nr_jobs : 1,
+						  sizeof(struct pool_job *));
+		workers[i].nr_jobs = 0;
+	}
+
+	for (i = 0; i < nr_jobs; i++) {
+		worker = owners[i];
+		worker->jobs[worker->nr_jobs++] = &jobs[i];
+	}
+
+	free(owners);
+
+	for (i = 0; i < nr_workers; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+			die("cannot create worker %d", i);
+
+	log_msg("%d workers monitoring %d cpus\n", nr_workers, nr_jobs);
+}
+
+/*
+ * A new tick: run the monitors of the active CPUs.
+ */
+void worker_pool_kick(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	pool_epoch++;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/*
+ * Wait for the workers to finish, once running is cleared.
+ */
+void worker_pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		free(workers[i].jobs);
+	}
+
+	free(workers);
+	free(jobs);
+	workers = NULL;
+	jobs = NULL;
+	nr_workers = 0;
+}
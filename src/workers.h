@@ -0,0 +1,17 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#ifndef __WORKERS_H
+#define __WORKERS_H
+
+/*
+ * One cycle of a per-CPU monitor. Returns > 0 if the CPU had work to do,
+ * 0 if it had nothing to do, < 0 on error.
+ */
+typedef int (*monitor_fn)(struct cpu_info *cpu);
+
+void worker_pool_start(struct cpu_info *cpus, int nr_cpus, monitor_fn monitor, int persistent);
+void worker_pool_kick(void);
+void worker_pool_stop(void);
+
+#endif /* __WORKERS_H */
@@ -0,0 +1,341 @@
+/*
+ * bench_parse - measure the sched_debug parser over a corpus of synthetic
+ *		 sched_debug snapshots, replayed through the replay backend.
+ *
+ * The corpus covers small to very large machines, the old (3.10) and new
+ * (4.18+/6.12+) task formats and very long run queues. It is generated
+ * on each run, as the old format lines refer to the benchmark's own pid,
+ * in a temporary directory removed on exit unless -d gives one.
+ *
+ * Each corpus has to parse to all its tasks but the current ones waiting,
+ * or the benchmark fails.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stalld.h"
+#include "sched_debug.h"
+
+#define NR_SNAPSHOTS	2
+
+struct corpus {
+	const char *name;
+	int nr_cpus;
+	int format;
+	int nr_tasks;	/* runnable tasks per CPU, including the current one */
+};
+
+static struct corpus corpora[] = {
+	{ "old-4cpu",		4,	OLD_TASK_FORMAT,	4 },
+	{ "old-64cpu",		64,	OLD_TASK_FORMAT,	4 },
+	{ "old-512cpu",		512,	OLD_TASK_FORMAT,	4 },
+	{ "old-1024cpu",	1024,	OLD_TASK_FORMAT,	4 },
+	{ "new-4cpu",		4,	NEW_TASK_FORMAT,	4 },
+	{ "new-64cpu",		64,	NEW_TASK_FORMAT,	4 },
+	{ "new-512cpu",		512,	NEW_TASK_FORMAT,	4 },
+	{ "new-1024cpu",	1024,	NEW_TASK_FORMAT,	4 },
+	{ "old-longrq",		8,	OLD_TASK_FORMAT,	512 },
+	{ "new-longrq",		8,	NEW_TASK_FORMAT,	2048 },
+	{ NULL },
+};
+
+static int iterations = 5;
+static char *corpus_dir;
+static char tmp_corpus_dir[] = "/tmp/bench_parse.XXXXXX";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void write_cpu_header(FILE *f, struct corpus *c, int cpu)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	fprintf(f, "cpu#%d, 2400.000 MHz\n", cpu);
+#else
+	fprintf(f, "cpu#%d\n", cpu);
+#endif
+	fprintf(f, "  .nr_running                    : %d\n", c->nr_tasks);
+	fprintf(f, "  .nr_switches                   : %d\n", 1000 + cpu);
+	fprintf(f, "  .nr_uninterruptible            : 0\n");
+	fprintf(f, "  .next_balance                  : 4295.000000\n");
+	fprintf(f, "  .curr->pid                     : %d\n", 1000 + cpu);
+	fprintf(f, "  .clock                         : 123456.789000\n");
+	fprintf(f, "  .clock_task                    : 123456.789000\n");
+	fprintf(f, "  .avg_idle                      : 1000000\n");
+	fprintf(f, "  .max_idle_balance_cost         : 500000\n\n");
+
+	fprintf(f, "cfs_rq[%d]:/\n", cpu);
+	fprintf(f, "  .min_vruntime                  : 1234.567890\n");
+	fprintf(f, "  .nr_running                    : %d\n", c->nr_tasks - 1);
+	fprintf(f, "  .h_nr_running                  : %d\n", c->nr_tasks - 1);
+	fprintf(f, "  .load                          : 1048576\n\n");
+
+	fprintf(f, "rt_rq[%d]:\n", cpu);
+	fprintf(f, "  .rt_nr_running                 : 1\n");
+	fprintf(f, "  .rt_throttled                  : 0\n");
+	fprintf(f, "  .rt_time                       : 0.000000\n");
+	fprintf(f, "  .rt_runtime                    : 950.000000\n\n");
+
+	fprintf(f, "dl_rq[%d]:\n", cpu);
+	fprintf(f, "  .dl_nr_running                 : 0\n");
+	fprintf(f, "  .dl_bw->bw                     : 996147\n");
+	fprintf(f, "  .dl_bw->total_bw               : 0\n\n");
+}
+
+static void write_old_tasks(FILE *f, struct corpus *c, int cpu)
+{
+	int i;
+
+	fprintf(f, "runnable tasks:\n");
+	fprintf(f, "            task   PID         tree-key  switches  prio"
+		   "     wait-time             sum-exec        sum-sleep\n");
+	fprintf(f, "----------------------------------------------------------"
+		   "------------------------------------------------\n");
+
+	fprintf(f, "R        rt-busy %5d        -8.984472       151     0"
+		   "         0.000000  123456.535614         0.000000 0 /\n",
+		1000 + cpu);
+
+	/*
+	 * The old format has no task state, so the parser reads
+	 * /proc/<pid>/stat for each line: use our own, runnable, pid.
+	 */
+	for (i = 1; i < c->nr_tasks; i++)
+		fprintf(f, "      kworker/%d:%d %5d      2382.087644        56   120"
+			   "         0.000000        16.444493         0.000000 0 /\n",
+			cpu, i, getpid());
+	fprintf(f, "\n");
+}
+
+static void write_new_tasks(FILE *f, struct corpus *c, int cpu)
+{
+	int i;
+
+	fprintf(f, "runnable tasks:\n");
+	fprintf(f, " S            task   PID       vruntime   eligible    deadline"
+		   "             slice          sum-exec      switches  prio"
+		   "         wait-time        sum-sleep       sum-block  node"
+		   "   group-id  group-path\n");
+	fprintf(f, "----------------------------------------------------------"
+		   "-----------------------------------------------------------"
+		   "----------------------------------------------------------"
+		   "------------------\n");
+
+	fprintf(f, ">R         rt-busy %5d         0.000000   E           0.000000"
+		   "          0.000000     123456.700000       151     0"
+		   "         0.000000         0.000000         0.000000   0      0        /\n",
+		1000 + cpu);
+
+	for (i = 1; i < c->nr_tasks; i++)
+		fprintf(f, " R kworker/%d:%d %7d        -1.048576   E          -1.040501"
+			   "           0.700000         0.000000         2     120"
+			   "         0.000000         0.000000         0.000000   0      0        /\n",
+			cpu, i, 100000 + cpu * c->nr_tasks + i);
+	fprintf(f, "\n");
+}
+
+static void write_snapshot(struct corpus *c, const char *path)
+{
+	FILE *f;
+	int cpu;
+
+	f = fopen(path, "w");
+	if (!f)
+		die("cannot create %s: %s\n", path, strerror(errno));
+
+	fprintf(f, "Sched Debug Version: v0.11, 6.12.0 #1\n");
+	fprintf(f, "ktime                                   : 123456.789000\n");
+	fprintf(f, "sched_clk                               : 123456.789000\n");
+	fprintf(f, "cpu_clk                                 : 123456.789000\n");
+	fprintf(f, "jiffies                                 : 4418063104\n\n");
+	fprintf(f, "sysctl_sched\n");
+	fprintf(f, "  .sysctl_sched_base_slice                 : 3.000000\n");
+	fprintf(f, "  .sysctl_sched_features                   : 6237751\n");
+	fprintf(f, "  .sysctl_sched_tunable_scaling            : 1 (logarithmic)\n\n");
+
+	for (cpu = 0; cpu < c->nr_cpus; cpu++) {
+		write_cpu_header(f, c, cpu);
+		if (c->format == OLD_TASK_FORMAT)
+			write_old_tasks(f, c, cpu);
+		else
+			write_new_tasks(f, c, cpu);
+	}
+
+	fclose(f);
+}
+
+static void generate_corpus(struct corpus *c, const char *dir)
+{
+	char path[MAX_PATH];
+	int i;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		die("cannot create %s: %s\n", dir, strerror(errno));
+
+	/*
+	 * Nothing runs between the snapshots, so the merge carries the
+	 * starving time forward like on a real starving system.
+	 */
+	for (i = 0; i < NR_SNAPSHOTS; i++) {
+		snprintf(path, sizeof(path), "%s/snapshot%d", dir, i);
+		write_snapshot(c, path);
+	}
+}
+
+static void remove_corpus(void)
+{
+	char path[MAX_PATH];
+	struct corpus *c;
+	int i;
+
+	for (c = corpora; c->name; c++) {
+		for (i = 0; i < NR_SNAPSHOTS; i++) {
+			snprintf(path, sizeof(path), "%s/%s/snapshot%d", corpus_dir, c->name, i);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/%s", corpus_dir, c->name);
+		rmdir(path);
+	}
+	rmdir(corpus_dir);
+}
+
+static void run_corpus(struct corpus *c)
+{
+	uint64_t start, read_ns = 0, parse_ns = 0;
+	struct cpu_info *cpus;
+	char dir[MAX_DIR_PATH];
+	size_t buffer_size;
+	long nr_lines;
+	long waiting;
+	char *buffer;
+	int iter, i;
+
+	snprintf(dir, sizeof(dir), "%s/%s", corpus_dir, c->name);
+	generate_corpus(c, dir);
+
+	config_nr_cpus = c->nr_cpus;
+	config_replay_path = dir;
+	if (replay_backend.init())
+		die("cannot init the replay backend\n");
+
+	cpus = allocate_aligned_memory(c->nr_cpus, sizeof(struct cpu_info));
+	for (i = 0; i < c->nr_cpus; i++)
+		cpus[i].id = i;
+
+	buffer = allocate_memory(config_buffer_size, sizeof(*buffer));
+	buffer_size = config_buffer_size;
+
+	/* iteration 0 is a warm up: buffer sizing and the first merge. */
+	for (iter = 0; iter <= iterations; iter++) {
+		resize_buffer_if_needed(&buffer, &buffer_size);
+
+		start = now_ns();
+		if (!replay_backend.get(buffer, buffer_size))
+			die("cannot read snapshot\n");
+		if (iter)
+			read_ns += now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < c->nr_cpus; i++)
+			replay_backend.parse(&cpus[i], buffer, buffer_size);
+		if (iter)
+			parse_ns += now_ns() - start;
+	}
+
+	nr_lines = (long) c->nr_cpus * c->nr_tasks;
+	for (waiting = 0, i = 0; i < c->nr_cpus; i++)
+		waiting += cpus[i].nr_waiting_tasks;
+	read_ns /= iterations;
+	parse_ns /= iterations;
+
+	printf("%-14s %6d %8ld %8ld %10.3f %12.3f %12llu %10llu\n",
+	       c->name, c->nr_cpus, nr_lines, waiting,
+	       (double) read_ns / 1000000, (double) parse_ns / 1000000,
+	       (unsigned long long) parse_ns / c->nr_cpus,
+	       (unsigned long long) parse_ns / nr_lines);
+
+	/* All the tasks wait, but the current one of each CPU. */
+	if (waiting != (long) c->nr_cpus * (c->nr_tasks - 1))
+		die("%s: %ld waiting tasks, expected %ld\n", c->name, waiting,
+		    (long) c->nr_cpus * (c->nr_tasks - 1));
+
+	for (i = 0; i < c->nr_cpus; i++) {
+		free(cpus[i].task_arrays[0]);
+		free(cpus[i].task_arrays[1]);
+	}
+	free(cpus);
+	free(buffer);
+
+	replay_backend.destroy();
+}
+
+static void usage_bench(void)
+{
+	fprintf(stderr, "usage: bench_parse [-i iterations] [-d corpus-dir] [corpus-name ...]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	struct corpus *c;
+	int selected;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "i:d:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = atoi(optarg);
+			if (iterations < 1)
+				usage_bench();
+			break;
+		case 'd':
+			corpus_dir = optarg;
+			break;
+		default:
+			usage_bench();
+		}
+	}
+
+	page_size = sysconf(_SC_PAGE_SIZE);
+	config_log_syslog = 0;
+	config_single_threaded = 0;
+
+	if (!corpus_dir) {
+		corpus_dir = mkdtemp(tmp_corpus_dir);
+		if (!corpus_dir)
+			die("cannot create %s: %s\n", tmp_corpus_dir, strerror(errno));
+		atexit(remove_corpus);
+	} else if (mkdir(corpus_dir, 0755) && errno != EEXIST) {
+		die("cannot create %s: %s\n", corpus_dir, strerror(errno));
+	}
+
+	printf("%-14s %6s %8s %8s %10s %12s %12s %10s\n",
+	       "corpus", "cpus", "lines", "waiting", "read[ms]", "parse[ms]", "ns/cpu", "ns/line");
+
+	for (c = corpora; c->name; c++) {
+		selected = optind == argc;
+		for (i = optind; i < argc; i++)
+			if (!strcmp(argv[i], c->name))
+				selected = 1;
+		if (selected)
+			run_corpus(c);
+	}
+
+	return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * scan_interval - check the interval until the next scan of a CPU
+ *
+ * A task first seen in a scan has a since after the time the scan
+ * started, and it has to be taken as just waiting.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stalld.h"
+
+static void check_interval(struct cpu_info *cpu, uint64_t now, uint64_t expected,
+			   const char *what)
+{
+	uint64_t interval;
+
+	interval = get_scan_interval(cpu, now, 0);
+	if (interval != expected)
+		die("scan interval of %s: %llu ns, expected %llu ns\n", what,
+		    (unsigned long long) interval, (unsigned long long) expected);
+}
+
+int main(void)
+{
+	struct task_info tasks[2];
+	struct cpu_info cpu;
+	uint64_t now = 10 * NS_PER_SEC;
+
+	config_log_syslog = 0;
+	config_starving_threshold = 2 * NS_PER_SEC;
+	config_granularity = 5 * NS_PER_SEC;
+
+	memset(&cpu, 0, sizeof(cpu));
+	memset(tasks, 0, sizeof(tasks));
+	cpu.starving = tasks;
+
+	/* A new task is scanned again before half the threshold. */
+	tasks[0].since = now + NS_PER_MS;
+	cpu.nr_waiting_tasks = 1;
+	check_interval(&cpu, now, NS_PER_SEC, "a new task");
+
+	/* The closest to starving sets the pace. */
+	tasks[1].since = now - 1500 * NS_PER_MS;
+	cpu.nr_waiting_tasks = 2;
+	check_interval(&cpu, now, 250 * NS_PER_MS, "a waiting task");
+
+	printf("scan_interval: ok\n");
+
+	return 0;
+}